@@ -57,10 +57,23 @@
  */
 #define ALIGNMENT 8  
 
+/*
+ * Set MEM_MMAP to 1 to back the heap with a reserved virtual range
+ * that is committed as the heap grows and handed back to the kernel
+ * when it shrinks, instead of one malloc'ed block. The allocator may
+ * then also give very large blocks mappings of their own.
+ */
+#define MEM_MMAP 0
+
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes (the size of the reservation with MEM_MMAP)
  */
+#if MEM_MMAP
+#define MAX_HEAP (1UL<<30)     /* 1 GB */
+#define MEM_COMMIT (64*(1<<10)) /* heap pages are made accessible 64 KB at a time */
+#else
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -10,9 +10,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -20,6 +24,7 @@
 #include "fsecs.h"
 #include "memlib.h"
 #include "mm.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -32,6 +37,15 @@
     (i + 5) /* cnvt trace request nums to linenums (origin 1) \
              */
 
+/* Multi-threaded benchmark (-T) */
+#define MAX_THREADS 64
+#define RING_SIZE 1024    /* blocks in flight from one thread to the next */
+#define PC_BLOCKS 200000  /* blocks each producer/consumer thread allocates */
+
+/* Returns true if timespec a is earlier than b */
+#define TS_BEFORE(a, b) \
+    ((a).tv_sec < (b).tv_sec || ((a).tv_sec == (b).tv_sec && (a).tv_nsec < (b).tv_nsec))
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -46,13 +60,6 @@ typedef struct range_t {
     struct range_t* next; /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    int index;                          /* index for free() to use later */
-    int size;                           /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +67,8 @@ typedef struct {
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
     traceop_t* ops;      /* array of requests */
+    void* map;           /* mapped binary trace file that ops points into... */
+    size_t map_size;     /* ... and its size, or NULL and 0 for a text trace */
     char** blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t* block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
@@ -74,6 +83,30 @@ typedef struct {
     range_t* ranges;
 } speed_t;
 
+/*
+ * Per-thread parameters of the multi-threaded benchmark. Threads replay
+ * the same trace ops into blocks of their own.
+ */
+typedef struct {
+    int id;
+    int nthreads;
+    trace_t* trace;
+    char** blocks;
+    pthread_barrier_t* start; /* released once every thread is ready */
+    struct timespec t0, t1;   /* when the thread started and finished */
+} bench_t;
+
+/*
+ * Single-producer, single-consumer queue of blocks from thread i to
+ * thread i + 1, which frees them. head and tail sit on separate cache
+ * lines so that the two ends do not share one.
+ */
+typedef struct {
+    char* slots[RING_SIZE];
+    unsigned head __attribute__((aligned(64))); /* next slot to pop */
+    unsigned tail __attribute__((aligned(64))); /* next slot to push */
+} ring_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -94,6 +127,9 @@ int verbose = 0;       /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 char msg[2 * MAXLINE]; /* for whenever we need to compose an error message */
 
+/* One queue per thread for the producer/consumer benchmark */
+static ring_t rings[MAX_THREADS];
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -115,6 +151,7 @@ static void clear_ranges(range_t** ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t* read_trace(char* tracedir, char* filename);
+static int map_trace(trace_t* trace, FILE* tracefile, char* path);
 static void free_trace(trace_t* trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -127,6 +164,12 @@ static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges);
 static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges);
 static void eval_mm_speed(void* ptr);
 
+/* Routines for the multi-threaded benchmark of mm.c */
+static void eval_mm_threads(char** tracefiles, int num_tracefiles, int max_threads);
+static double run_threads(int nthreads, void* (*routine)(void*), trace_t* trace);
+static void* bench_replay(void* arg);
+static void* bench_prodcons(void* arg);
+
 /* Various helper routines */
 static void printresults(int n, stats_t* stats);
 static void usage(void);
@@ -151,6 +194,7 @@ int main(int argc, char** argv) {
     int team_check = 1; /* If set, check team structure (reset by -a) */
     int run_libc = 0;   /* If set, run libc malloc (set by -l) */
     int autograder = 0; /* If set, emit summary info for autograder (-g) */
+    int threads = 0;    /* If set, benchmark up to this many threads (-T) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -159,7 +203,7 @@ int main(int argc, char** argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:hvVgal")) != EOF) {
         switch (c) {
             case 'g': /* Generate summary info for the autograder */
                 autograder = 1;
@@ -181,6 +225,13 @@ int main(int argc, char** argv) {
                 if (tracedir[strlen(tracedir) - 1] != '/')
                     strcat(tracedir, "/"); /* path always ends with "/" */
                 break;
+            case 'T': /* Benchmark mm.c with 1, 2, 4, ... threads */
+                threads = atoi(optarg);
+                if (threads < 1 || threads > MAX_THREADS) {
+                    fprintf(stderr, "-T takes 1 to %d threads\n", MAX_THREADS);
+                    exit(1);
+                }
+                break;
             case 'a': /* Don't check team structure */
                 team_check = 0;
                 break;
@@ -243,6 +294,15 @@ int main(int argc, char** argv) {
     /* Initialize the timing package */
     init_fsecs();
 
+    /*
+     * The multi-threaded benchmark replaces the usual evaluation
+     */
+    if (threads) {
+        mem_init();
+        eval_mm_threads(tracefiles, num_tracefiles, threads);
+        exit(0);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -397,9 +457,11 @@ static int add_range(range_t** ranges,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char*)mem_heap_lo()) || (lo > (char*)mem_heap_hi()) ||
-        (hi < (char*)mem_heap_lo()) || (hi > (char*)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a mapping
+     * the package got from mem_map */
+    if (((lo < (char*)mem_heap_lo()) || (lo > (char*)mem_heap_hi()) ||
+         (hi < (char*)mem_heap_lo()) || (hi > (char*)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)", lo, hi,
                 mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
@@ -465,7 +527,8 @@ static void clear_ranges(range_t** ranges) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. Binary traces
+ *     are mapped rather than read.
  */
 static trace_t* read_trace(char* tracedir, char* filename) {
     FILE* tracefile;
@@ -480,7 +543,7 @@ static trace_t* read_trace(char* tracedir, char* filename) {
         printf("Reading tracefile: %s\n", filename);
 
     /* Allocate the trace record */
-    if ((trace = (trace_t*)malloc(sizeof(trace_t))) == NULL)
+    if ((trace = (trace_t*)calloc(1, sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trance");
 
     /* Read the trace file header */
@@ -490,15 +553,17 @@ static trace_t* read_trace(char* tracedir, char* filename) {
         sprintf(msg, "Could not open %s in read_trace", path);
         unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));
-    fscanf(tracefile, "%d", &(trace->num_ops));
-    fscanf(tracefile, "%d", &(trace->weight)); /* not used */
-
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = (traceop_t*)malloc(trace->num_ops * sizeof(traceop_t))) ==
-        NULL)
-        unix_error("malloc 2 failed in read_trace");
+    if (!map_trace(trace, tracefile, path)) {
+        fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+        fscanf(tracefile, "%d", &(trace->num_ids));
+        fscanf(tracefile, "%d", &(trace->num_ops));
+        fscanf(tracefile, "%d", &(trace->weight)); /* not used */
+
+        /* We'll store each request line in the trace in this array */
+        if ((trace->ops = (traceop_t*)malloc(trace->num_ops *
+                                             sizeof(traceop_t))) == NULL)
+            unix_error("malloc 2 failed in read_trace");
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = (char**)malloc(trace->num_ids * sizeof(char*))) ==
@@ -513,7 +578,7 @@ static trace_t* read_trace(char* tracedir, char* filename) {
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
+    while (trace->map == NULL && fscanf(tracefile, "%s", type) != EOF) {
         switch (type[0]) {
             case 'a':
                 fscanf(tracefile, "%u %u", &index, &size);
@@ -542,18 +607,68 @@ static trace_t* read_trace(char* tracedir, char* filename) {
         op_index++;
     }
     fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+    if (trace->map == NULL) {
+        assert(max_index == trace->num_ids - 1);
+        assert(trace->num_ops == op_index);
+    }
 
     return trace;
 }
 
+/*
+ * map_trace - if tracefile is a binary trace (see trace.h), map it and
+ *     point trace->ops at its records. Returns 0, with the file position
+ *     back at the start, if it is a text trace.
+ */
+static int map_trace(trace_t* trace, FILE* tracefile, char* path) {
+    trace_hdr_t hdr;
+    struct stat sbuf;
+    int i;
+
+    if (fread(&hdr, sizeof(hdr), 1, tracefile) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        rewind(tracefile);
+        return 0;
+    }
+    if (fstat(fileno(tracefile), &sbuf) < 0)
+        unix_error("fstat failed in map_trace");
+    if (hdr.num_ops < 0 || hdr.num_ids < 0 ||
+        sbuf.st_size != sizeof(hdr) + (off_t)hdr.num_ops * sizeof(traceop_t)) {
+        printf("Truncated binary tracefile %s\n", path);
+        exit(1);
+    }
+    trace->map_size = sbuf.st_size;
+    if ((trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE,
+                           fileno(tracefile), 0)) == MAP_FAILED)
+        unix_error("mmap failed in map_trace");
+    trace->sugg_heapsize = hdr.sugg_heapsize;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->weight = hdr.weight;
+    trace->ops = (traceop_t*)((char*)trace->map + sizeof(hdr));
+
+    /* The driver indexes blocks[] with these and passes sizes on as size_t, so check them once */
+    for (i = 0; i < trace->num_ops; i++) {
+        if ((unsigned)trace->ops[i].type > REALLOC ||
+            trace->ops[i].index < 0 || trace->ops[i].index >= trace->num_ids ||
+            trace->ops[i].size < 0) {
+            printf("Bogus request %d in tracefile %s\n", i, path);
+            exit(1);
+        }
+    }
+    return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or, for the ops of a
+ *              binary trace, mapped) in read_trace().
  */
 void free_trace(trace_t* trace) {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map != NULL) /* free the three arrays... */
+        munmap(trace->map, trace->map_size);
+    else
+        free(trace->ops);
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace); /* and the trace record itself... */
@@ -645,7 +760,7 @@ static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges) {
                 if (size < oldsize)
                     oldsize = size;
                 for (j = 0; j < oldsize; j++) {
-                    if (newp[j] != (index & 0xFF)) {
+                    if ((unsigned char)newp[j] != (index & 0xFF)) {
                         malloc_error(tracenum, i,
                                      "mm_realloc did not preserve the "
                                      "data from old block");
@@ -681,10 +796,10 @@ static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   high water mark of the heap plus any mem_map mappings while
+ *   running the student's malloc package on the trace, as kept by
+ *   mem_peaksize(). With MEM_MMAP the brk can move back, so the brk
+ *   at the end is not necessarily the high water mark.
  *
  */
 static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges) {
@@ -763,7 +878,7 @@ static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges) {
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 /*
@@ -811,6 +926,196 @@ static void eval_mm_speed(void* ptr) {
         }
 }
 
+/*
+ * eval_mm_threads - Measure how mm.c scales: for 1, 2, 4, ... up to
+ *    max_threads threads, every thread replays each trace at the same
+ *    time on blocks of its own, and then the threads pass blocks to
+ *    each other to be freed. Prints the aggregate throughput of both.
+ *    Traces are left out when max_threads copies of their peak
+ *    footprint would fill more than half the heap, so that every row
+ *    replays the same traces.
+ */
+static void eval_mm_threads(char** tracefiles,
+                            int num_tracefiles,
+                            int max_threads) {
+    trace_t** traces;
+    double secs, ops;
+    int i, k, n = 0;
+
+    if ((traces = (trace_t**)malloc(num_tracefiles * sizeof(trace_t*))) ==
+        NULL)
+        unix_error("malloc failed in eval_mm_threads");
+    for (i = 0; i < num_tracefiles; i++) {
+        traces[n] = read_trace(tracedir, tracefiles[i]);
+        run_threads(1, bench_replay, traces[n]);
+        if (verbose > 1)
+            printf("%s: peak footprint %lu bytes\n", tracefiles[i],
+                   (unsigned long)mem_peaksize());
+        if ((double)max_threads * mem_peaksize() <= MAX_HEAP / 2)
+            n++;
+        else
+            free_trace(traces[n]);
+    }
+
+    printf("\nResults for mm malloc with threads (%d of %d traces):\n", n,
+           num_tracefiles);
+    printf("%7s%14s%14s%16s\n", "threads", "replay Kops", "Kops/thread",
+           "prodcons Kops");
+    for (k = 1;; k = (2 * k > max_threads) ? max_threads : 2 * k) {
+        secs = 0;
+        ops = 0;
+        for (i = 0; i < n; i++) {
+            secs += run_threads(k, bench_replay, traces[i]);
+            ops += (double)k * traces[i]->num_ops;
+        }
+        if (n > 0)
+            printf("%7d%14.0f%14.0f", k, ops / 1e3 / secs,
+                   ops / 1e3 / secs / k);
+        else
+            printf("%7d%14s%14s", k, "-", "-");
+
+        secs = run_threads(k, bench_prodcons, NULL);
+        ops = 2.0 * k * PC_BLOCKS;
+        printf("%16.0f\n", ops / 1e3 / secs);
+        if (k == max_threads)
+            break;
+    }
+
+    for (i = 0; i < n; i++)
+        free_trace(traces[i]);
+    free(traces);
+}
+
+/*
+ * run_threads - Start nthreads threads running routine on a fresh heap
+ *    and return the wall-clock seconds until the last one finishes
+ */
+static double run_threads(int nthreads, void* (*routine)(void*), trace_t* trace) {
+    pthread_t tids[MAX_THREADS];
+    bench_t bench[MAX_THREADS];
+    pthread_barrier_t start;
+    struct timespec t0, t1;
+    int i;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in run_threads");
+    memset(rings, 0, sizeof(rings));
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        bench[i].id = i;
+        bench[i].nthreads = nthreads;
+        bench[i].trace = trace;
+        bench[i].blocks = NULL;
+        if (trace != NULL &&
+            (bench[i].blocks = (char**)calloc(trace->num_ids, sizeof(char*))) ==
+                NULL)
+            unix_error("calloc failed in run_threads");
+        bench[i].start = &start;
+        if ((errno = pthread_create(&tids[i], NULL, routine, &bench[i])) != 0)
+            unix_error("pthread_create failed in run_threads");
+    }
+
+    /* Time from the first thread starting to the last one finishing */
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    t0 = bench[0].t0;
+    t1 = bench[0].t1;
+    for (i = 0; i < nthreads; i++) {
+        if (TS_BEFORE(bench[i].t0, t0))
+            t0 = bench[i].t0;
+        if (TS_BEFORE(t1, bench[i].t1))
+            t1 = bench[i].t1;
+        free(bench[i].blocks);
+    }
+    pthread_barrier_destroy(&start);
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/*
+ * bench_replay - One benchmark thread: replay the trace on its own blocks
+ */
+static void* bench_replay(void* arg) {
+    bench_t* b = (bench_t*)arg;
+    trace_t* trace = b->trace;
+    char* p;
+    int i;
+
+    pthread_barrier_wait(b->start);
+    clock_gettime(CLOCK_MONOTONIC, &b->t0);
+    for (i = 0; i < trace->num_ops; i++) {
+        switch (trace->ops[i].type) {
+            case ALLOC: /* mm_malloc */
+                if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+                    app_error("mm_malloc error in bench_replay");
+                b->blocks[trace->ops[i].index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                p = mm_realloc(b->blocks[trace->ops[i].index],
+                               trace->ops[i].size);
+                if (p == NULL)
+                    app_error("mm_realloc error in bench_replay");
+                b->blocks[trace->ops[i].index] = p;
+                break;
+
+            case FREE: /* mm_free */
+                mm_free(b->blocks[trace->ops[i].index]);
+                break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b->t1);
+    return NULL;
+}
+
+/*
+ * bench_prodcons - One benchmark thread: allocate PC_BLOCKS blocks and
+ *    queue them to the next thread, while freeing the PC_BLOCKS blocks
+ *    the previous thread queues. Sizes are mostly small, with the odd
+ *    larger block.
+ */
+static void* bench_prodcons(void* arg) {
+    bench_t* b = (bench_t*)arg;
+    ring_t* out = &rings[b->id];
+    ring_t* in = &rings[(b->id + b->nthreads - 1) % b->nthreads];
+    unsigned seed = b->id + 1;
+    unsigned head, tail;
+    int made = 0, freed = 0, progress;
+    size_t size;
+    char* p;
+
+    pthread_barrier_wait(b->start);
+    clock_gettime(CLOCK_MONOTONIC, &b->t0);
+    while (made < PC_BLOCKS || freed < PC_BLOCKS) {
+        progress = 0;
+        tail = out->tail;
+        if (made < PC_BLOCKS &&
+            tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SIZE) {
+            size = (rand_r(&seed) % 16) ? 8 + rand_r(&seed) % 248
+                                        : 256 + rand_r(&seed) % 3840;
+            if ((p = mm_malloc(size)) == NULL)
+                app_error("mm_malloc error in bench_prodcons");
+            *p = (char)b->id; /* touch it, as a real producer would */
+            out->slots[tail % RING_SIZE] = p;
+            __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+            made++;
+            progress = 1;
+        }
+        head = in->head;
+        if (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+            mm_free(in->slots[head % RING_SIZE]);
+            __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+            freed++;
+            progress = 1;
+        }
+        if (!progress) /* let the other end run if it shares our CPU */
+            sched_yield();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b->t1);
+    return NULL;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -959,7 +1264,8 @@ void malloc_error(int tracenum, int opnum, char* msg) {
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr,
+            "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-T <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
@@ -967,6 +1273,8 @@ static void usage(void) {
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr,
+            "\t-T <n>     Benchmark threads instead, 1, 2, 4, ... up to <n>.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
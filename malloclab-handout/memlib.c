@@ -2,9 +2,16 @@
  * memlib.c - a module that simulates the memory system.  Needed because it
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
+ *
+ * With MEM_MMAP the heap is a PROT_NONE reservation of MAX_HEAP bytes
+ * whose pages are made accessible as the brk passes them and returned to
+ * the kernel with MADV_DONTNEED when it moves back. mem_map hands out
+ * separate mappings, which count toward the footprint like heap bytes.
  */
+#define _GNU_SOURCE /* mremap */
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,20 +21,46 @@
 #include "config.h"
 #include "memlib.h"
 
+#define PAGE_ROUND(n) (((uintptr_t)(n) + mem_pagesize() - 1) & ~(uintptr_t)(mem_pagesize() - 1))
+
+/* A live mapping from mem_map */
+typedef struct mapping {
+    char* lo;
+    size_t size;
+    struct mapping* next;
+} mapping_t;
+
 /* private variables */
 static char* mem_start_brk; /* points to first byte of heap */
 static char* mem_brk;       /* points to last byte of heap */
 static char* mem_max_addr;  /* largest legal heap address */
+#if MEM_MMAP
+static char* mem_commit;    /* heap pages below this are accessible */
+#endif
+static mapping_t* mem_maps; /* live mappings from mem_map */
+static size_t mem_mapped;   /* bytes in them */
+static size_t mem_peak;     /* most heap plus mapped bytes since the last reset */
+
+static void mem_update_peak(void);
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
     /* allocate the storage we will use to model the available VM */
+#if MEM_MMAP
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
+        exit(1);
+    }
+    mem_commit = mem_start_brk;
+#else
     if ((mem_start_brk = (char*)malloc(MAX_HEAP)) == NULL) {
         fprintf(stderr, "mem_init_vm: malloc error\n");
         exit(1);
     }
+#endif
 
     mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
     mem_brk = mem_start_brk;                 /* heap is empty initially */
@@ -37,33 +70,151 @@ void mem_init(void) {
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
+    mem_reset_brk();
+#if MEM_MMAP
+    munmap(mem_start_brk, MAX_HEAP);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    Mappings still live are unmapped.
  */
 void mem_reset_brk() {
+    while (mem_maps != NULL)
+        mem_unmap(mem_maps->lo, mem_maps->size);
+#if MEM_MMAP
+    madvise(mem_start_brk, mem_commit - mem_start_brk, MADV_DONTNEED);
+#endif
     mem_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap can only be shrunk with MEM_MMAP, which
+ *    releases the pages given up.
  */
 void* mem_sbrk(int incr) {
     char* old_brk = mem_brk;
 
+#if MEM_MMAP
+    if (incr < 0) {
+        if (mem_brk + incr < mem_start_brk) {
+            errno = EINVAL;
+            return (void*)-1;
+        }
+        mem_brk += incr;
+        madvise((char*)PAGE_ROUND(mem_brk), PAGE_ROUND(old_brk) - PAGE_ROUND(mem_brk), MADV_DONTNEED);
+        return (void*)old_brk;
+    }
+#endif
     if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void*)-1;
     }
+#if MEM_MMAP
+    if (mem_brk + incr > mem_commit) {
+        char* commit = mem_start_brk + (mem_brk + incr - mem_start_brk + MEM_COMMIT - 1) / MEM_COMMIT * MEM_COMMIT;
+        if (commit > mem_max_addr)
+            commit = mem_max_addr;
+        if (mprotect(mem_commit, commit - mem_commit, PROT_READ | PROT_WRITE) < 0) {
+            fprintf(stderr, "ERROR: mem_sbrk failed. mprotect: %s\n", strerror(errno));
+            return (void*)-1;
+        }
+        mem_commit = commit;
+    }
+#endif
     mem_brk += incr;
+    mem_update_peak();
     return (void*)old_brk;
 }
 
+/*
+ * mem_map - a mapping of size bytes of its own, outside the heap, or NULL
+ *    without MEM_MMAP or if the kernel refuses
+ */
+void* mem_map(size_t size) {
+#if MEM_MMAP
+    mapping_t* m;
+    char* p;
+
+    size = PAGE_ROUND(size);
+    if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        return NULL;
+    if ((m = malloc(sizeof(mapping_t))) == NULL) {
+        munmap(p, size);
+        return NULL;
+    }
+    m->lo = p;
+    m->size = size;
+    m->next = mem_maps;
+    mem_maps = m;
+    mem_mapped += size;
+    mem_update_peak();
+    return p;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * mem_remap - resize a mapping from mem_map, moving it if need be.
+ *    Returns its new address, or NULL leaving it untouched.
+ */
+void* mem_remap(void* p, size_t old_size, size_t size) {
+#if MEM_MMAP
+    mapping_t* m;
+    char* q;
+
+    for (m = mem_maps; m != NULL && m->lo != p; m = m->next)
+        ;
+    assert(m != NULL && m->size == PAGE_ROUND(old_size));
+    size = PAGE_ROUND(size);
+    if ((q = mremap(p, m->size, size, MREMAP_MAYMOVE)) == MAP_FAILED)
+        return NULL;
+    mem_mapped += size - m->size;
+    m->lo = q;
+    m->size = size;
+    mem_update_peak();
+    return q;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * mem_unmap - release a mapping from mem_map
+ */
+void mem_unmap(void* p, size_t size) {
+    mapping_t **mp, *m;
+
+    for (mp = &mem_maps; *mp != NULL && (*mp)->lo != p; mp = &(*mp)->next)
+        ;
+    if ((m = *mp) == NULL)
+        return;
+    assert(m->size == PAGE_ROUND(size));
+    *mp = m->next;
+    mem_mapped -= m->size;
+    munmap(m->lo, m->size);
+    free(m);
+}
+
+/*
+ * mem_is_mapped - whether [lo, hi] lies within one mapping from mem_map
+ */
+int mem_is_mapped(void* lo, void* hi) {
+    for (mapping_t* m = mem_maps; m != NULL; m = m->next) {
+        if ((char*)lo >= m->lo && (char*)hi < m->lo + m->size)
+            return 1;
+    }
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -85,9 +236,24 @@ size_t mem_heapsize() {
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peaksize() - returns the most memory the heap and the mappings
+ *    together have used since the last mem_reset_brk
+ */
+size_t mem_peaksize() {
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize() {
     return (size_t)getpagesize();
 }
+
+static void mem_update_peak(void) {
+    size_t used = mem_heapsize() + mem_mapped;
+
+    if (used > mem_peak)
+        mem_peak = used;
+}
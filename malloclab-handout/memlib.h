@@ -7,5 +7,10 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peaksize(void);
 size_t mem_pagesize(void);
 
+void *mem_map(size_t size);
+void *mem_remap(void *p, size_t old_size, size_t size);
+void mem_unmap(void *p, size_t size);
+int mem_is_mapped(void *lo, void *hi);
@@ -1,20 +1,55 @@
 /*
- * mm-naive.c - The fastest, least memory-efficient malloc package.
+ * mm.c - segregated free lists behind per-thread caches.
  *
- * In this naive approach, a block is allocated by simply incrementing
- * the brk pointer.  A block is pure payload. There are no headers or
- * footers.  Blocks are never coalesced or reused. Realloc is
- * implemented directly using mm_malloc and mm_free.
+ * Every block starts with a header holding its size, an allocated bit and
+ * a bit saying whether the block before it is free. Only free blocks have
+ * a footer, which is all that coalescing needs from the left neighbor, so
+ * an allocated block costs one word. A zero-size allocated epilogue header
+ * ends the heap. Free blocks are coalesced with their neighbors when
+ * freed and kept in size bins indexed TLSF-style: the first level is the
+ * power of two below the size and the second splits it into SL_COUNT
+ * ranges, with a bitmap per level of the non-empty bins. A request is
+ * rounded up to the next bin boundary and takes the head of the smallest
+ * non-empty bin from there on, where every block fits, found in constant
+ * time by bit scans. Fragments too small to hold the links stay out of
+ * the bins until they coalesce. The bins form the central heap, which is
+ * guarded by heap_lock.
  *
- * NOTE TO STUDENTS: Replace this header comment with your own header
- * comment that gives a high level description of your solution.
+ * The free block at the top of the heap, if any, is the wilderness: a
+ * miss carves the request out of it, growing the heap by at least
+ * CHUNK_SIZE when it is too small, and frees at the top merge into it. Freed heap blocks of
+ * up to QUICK_MAX bytes are not coalesced right away; they wait on quick
+ * lists keyed by exact size, still marked allocated, where a request of
+ * that size takes them back. They are coalesced once QUICK_LIMIT of them
+ * pile up, or before the heap is grown.
+ *
+ * With MEM_MMAP, requests of MMAP_THRESHOLD bytes or more get a mapping
+ * of their own, which goes back to the kernel when they are freed, and a
+ * wilderness of TRIM_THRESHOLD bytes or more is trimmed to CHUNK_SIZE.
+ *
+ * Requests of up to SLAB_MAX bytes are served from slabs instead: heap
+ * blocks of SLAB_SIZE bytes, aligned to SLAB_SIZE, each cut into objects
+ * of one size class. Objects carry no header or footer; mm_free finds the
+ * slab by rounding the pointer down, once the page map says the page is a
+ * slab, and the slab records the class. Free objects are linked through
+ * their first word.
+ *
+ * Small objects go through a per-thread cache first, one bin per class,
+ * so most small malloc/free pairs never take the lock. An empty bin is
+ * refilled with a batch of objects under one lock acquisition and a full
+ * bin flushes a batch back the same way. mm_init starts a new heap
+ * generation, which makes every thread drop its cache on its next call.
  */
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "memlib.h"
 #include "mm.h"
 
@@ -39,88 +74,240 @@ typedef void* ptr;
 
 /* single word (4) or double word (8) alignment */
 #define ALIGNMENT 8
-#define NUM_LISTS 10
+#define SL_LOG 4
+#define SL_COUNT (1 << SL_LOG)
+#define FL_SHIFT (SL_LOG + 3) /* sizes below 1 << FL_SHIFT share level 0, in ALIGNMENT steps */
+#define FL_COUNT 32
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 #define PTR_SIZE (ALIGN(sizeof(ptr)))
-#define SIZE(p) (*(size_t*)(p) & -2)
-#define ALLOCATED(p) (*(size_t*)(p)&1)
+#define ALLOC 1
+#define PREV_FREE 2 /* the block to the left is free and has a footer */
+#define MAPPED 4    /* the block is a mapping of its own from mem_map */
+#define SIZE(p) (*(size_t*)(p) & ~(size_t)7)
+#define ALLOCATED(p) (*(size_t*)(p)&ALLOC)
+#define PREV_IS_FREE(p) (*(size_t*)(p)&PREV_FREE)
 #define HEADER(p) ((size_t*)(p))
 #define FOOTER(p) ((size_t*)((char*)(p) + SIZE(p) - SIZE_T_SIZE))
+#define NEXT_BLOCK(p) ((char*)(p) + SIZE(p))
 #define NEXT(p) ((ptr*)((char*)(p) + SIZE_T_SIZE))
 #define PREV(p) ((ptr*)((char*)(p) + SIZE_T_SIZE + PTR_SIZE))
+/* smallest block that can hold the list links while free */
+#define MIN_BLOCK ALIGN(2 * SIZE_T_SIZE + 2 * PTR_SIZE)
+#define BLOCK_SIZE(size) (ALIGN((size) + SIZE_T_SIZE) < MIN_BLOCK ? MIN_BLOCK : ALIGN((size) + SIZE_T_SIZE))
+/* largest request; its block neither wraps BLOCK_SIZE nor maps past the last first level */
+#define MAX_REQUEST ((size_t)1 << (FL_SHIFT + FL_COUNT - 2))
+
+#define CHUNK_SIZE 4096 /* least the heap grows by for a heap block */
+#define QUICK_MAX 1024  /* largest block kept on the quick lists */
+#define QUICK_LIMIT 64  /* quick-listed blocks before they are coalesced */
+#define MMAP_THRESHOLD (128 * 1024)
+#define TRIM_THRESHOLD (128 * 1024)
+#define PAGE_ROUND(n) (((n) + mem_pagesize() - 1) & ~(mem_pagesize() - 1))
+
+#define SLAB_SIZE 4096 /* also the slab alignment */
+#define SLAB_MAX 256   /* largest request served from a slab */
+#define SLAB_HEADER ALIGN(sizeof(slab_t))
+#define SLAB_PAGES (MAX_HEAP / SLAB_SIZE + 1)
+#define SLAB_ROUND(p) (((uintptr_t)(p) + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1))
+#define NUM_CLASSES 16
+
+#define TCACHE_COUNT 16 /* objects a bin holds before it flushes */
+#define TCACHE_BATCH 8  /* objects moved per refill or flush */
+
+/* Start of a slab; the first word doubles as the heap block header */
+typedef struct slab {
+    size_t header;               /* SLAB_SIZE | 1 */
+    struct slab *next, *prev;    /* slabs of the class with free objects */
+    ptr free;                    /* freed objects */
+    char* fresh;                 /* objects from here on were never handed out */
+    unsigned short cls, used, count;
+} slab_t;
+
+/* Per-thread cache of slab objects, allocated from the slabs' view */
+typedef struct {
+    ptr bins[NUM_CLASSES]; /* linked through the first word */
+    int counts[NUM_CLASSES];
+    unsigned gen; /* heap_gen the cached objects belong to */
+} tcache_t;
+
+static const unsigned short class_size[NUM_CLASSES] = {8,  16, 24,  32,  40,  48,  56,  64,
+                                                       80, 96, 112, 128, 160, 192, 224, 256};
 
 static void* mm_malloc_new(size_t size);
 static void* mm_malloc_old(size_t size);
-static void* find_list(size_t size);
-static int find_list_index(size_t size);
-static void* list_init();
+static void mm_free_block(void* p);
+static void* heap_alloc(size_t newsize);
+static void* mm_remap(char* p, size_t newsize);
+#if MEM_MMAP
+static void* mm_map(size_t newsize);
+static void mm_trim(char* p);
+#endif
+static void quick_put(void* p);
+static void* quick_take(size_t size);
+static void quick_flush(void);
+static void mark_free(void* p, size_t size);
+static void place(char* p, size_t total, size_t newsize);
+static int mm_resize(char* p, size_t newsize);
+static size_t mm_usable_size(void* p);
+static int size_class(size_t size);
+static slab_t* slab_of(void* p);
+static void* slab_alloc(int cls);
+static void slab_free(slab_t* s, void* p);
+static slab_t* slab_new(int cls);
+static void* slab_page(void);
+static char* slab_fit(char* b, char* end);
+static void* slab_carve(char* b, char* a, char* end);
+static void slab_link(slab_t* s);
+static void slab_unlink(slab_t* s);
+static tcache_t* tcache_get(void);
+static void tcache_refill(tcache_t* tc, int idx);
+static void tcache_flush(tcache_t* tc, int idx, int n);
+static void tcache_destroy(void* arg);
+static void tcache_key_init(void);
+static void* find_fit(size_t size);
+static void bin_index(size_t size, int* fl, int* sl);
 static void* list_push_front(void* p);
 static void* list_remove(void* p);
 
-static ptr root[NUM_LISTS];
+static ptr bins[FL_COUNT][SL_COUNT]; /* free blocks, linked through NEXT and PREV */
+static unsigned fl_bitmap;           /* first levels with a non-empty bin */
+static unsigned sl_bitmap[FL_COUNT]; /* non-empty bins of each first level */
+static ptr quick[QUICK_MAX / ALIGNMENT + 1]; /* freed blocks awaiting coalescing, by size */
+static int quick_count;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned heap_gen; /* bumped by mm_init; stale caches are dropped */
+
+static slab_t* partial[NUM_CLASSES];          /* slabs with free objects, per class */
+static unsigned char slab_pages[SLAB_PAGES]; /* nonzero where a page is a slab */
+static uintptr_t page_base;                  /* slab_pages[0] is the page holding this */
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key; /* flushes a thread's cache when it exits */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
 
 /*
- * mm_init - initialize the malloc package.
+ * mm_init - initialize the malloc package. Blocks cached by any thread
+ *     belong to the old heap and are forgotten.
  */
 int mm_init(void) {
-    for (size_t i = 0; i < NUM_LISTS; i++)
-        root[i] = list_init();
+    pthread_once(&tcache_once, tcache_key_init);
+    pthread_mutex_lock(&heap_lock);
+    page_base = (uintptr_t)mem_heap_lo() & ~(uintptr_t)(SLAB_SIZE - 1);
+    memset(slab_pages, 0, sizeof(slab_pages));
+    memset(partial, 0, sizeof(partial));
+    memset(bins, 0, sizeof(bins));
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    fl_bitmap = 0;
+    memset(quick, 0, sizeof(quick));
+    quick_count = 0;
+    *HEADER(mem_sbrk(SIZE_T_SIZE)) = ALLOC; // epilogue
+    __atomic_add_fetch(&heap_gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&heap_lock);
     return 0;
 }
 
 /*
- * mm_malloc - Allocate a block by incrementing the brk pointer.
- *     Always allocate a block whose size is a multiple of the alignment.
+ * mm_malloc - Allocate a small object from the thread's cache, refilled
+ *     from the slabs, and anything larger from the free lists, extending
+ *     the heap on a miss. Always allocate a block whose size is a
+ *     multiple of the alignment.
  */
 void* mm_malloc(size_t size) {
+    tcache_t* tc;
     void* p;
-    if ((p = mm_malloc_old(size)) == NULL)
-        return mm_malloc_new(size);
-    return p;
+
+    if (size == 0 || size > MAX_REQUEST)
+        return NULL;
+    if (size <= SLAB_MAX) {
+        int cls = size_class(size);
+        tc = tcache_get();
+        if (tc->bins[cls] == NULL)
+            tcache_refill(tc, cls);
+        if ((p = tc->bins[cls]) == NULL)
+            return NULL;
+        tc->bins[cls] = *(ptr*)p;
+        tc->counts[cls]--;
+        return p;
+    }
+
+    size_t newsize = BLOCK_SIZE(size);
+#if MEM_MMAP
+    if (newsize >= MMAP_THRESHOLD && (p = mm_map(newsize)) != NULL)
+        return p;
+#endif
+    pthread_mutex_lock(&heap_lock);
+    p = heap_alloc(newsize);
+    pthread_mutex_unlock(&heap_lock);
+    return p ? (void*)((char*)p + SIZE_T_SIZE) : NULL;
 }
 
 /*
- * mm_free - Freeing a block.
+ * mm_free - Freeing a block. Slab objects go back to the thread's cache
+ *     and reach their slabs in batches; small heap blocks wait on the
+ *     quick lists.
  */
 void mm_free(void* p) {
-    p = (char*)p - SIZE_T_SIZE;
-    if (!ALLOCATED(p))
-        return;
+    tcache_t* tc;
+    slab_t* s;
 
-    size_t block_size = SIZE(p);
-    if (!ALLOCATED((char*)p - SIZE_T_SIZE)) {
-        // merge front
-        size_t front_block_size = SIZE((char*)p - SIZE_T_SIZE);
-        p = (char*)p - front_block_size;
-        list_remove(p);
-        block_size += front_block_size;
-    }
-    if (((char*)p + block_size < (char*)mem_heap_hi()) &&
-        !ALLOCATED((char*)p + block_size)) {
-        // merge back
-        size_t back_block_size = SIZE((char*)p + block_size);
-        list_remove((char*)p + block_size);
-        block_size += back_block_size;
+    if (p == NULL)
+        return;
+    if ((s = slab_of(p)) != NULL) {
+        tc = tcache_get();
+        *(ptr*)p = tc->bins[s->cls];
+        tc->bins[s->cls] = p;
+        if (++tc->counts[s->cls] >= TCACHE_COUNT)
+            tcache_flush(tc, s->cls, TCACHE_BATCH);
+        return;
     }
-    *HEADER(p) = block_size;
-    *FOOTER(p) = block_size;
-    list_push_front(p);
+
+    p = (char*)p - SIZE_T_SIZE;
+    pthread_mutex_lock(&heap_lock);
+    if (*HEADER(p) & MAPPED)
+        mem_unmap(p, SIZE(p));
+    else if (SIZE(p) <= QUICK_MAX)
+        quick_put(p);
+    else
+        mm_free_block(p);
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * mm_realloc - Resize in place when the block allows it: a slab object
+ *     that stays in its class, or a heap block that shrinks, grows into a
+ *     free right neighbor or ends the heap. Otherwise copy.
  */
 void* mm_realloc(void* p, size_t size) {
     void* oldptr = p;
     void* newptr;
     size_t copySize;
+    slab_t* s;
+
+    if (p == NULL)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(p);
+        return NULL;
+    }
+    if (size > MAX_REQUEST)
+        return NULL;
+    if ((s = slab_of(p)) != NULL) {
+        if (size <= SLAB_MAX && size_class(size) == s->cls)
+            return p;
+    } else if (*HEADER((char*)p - SIZE_T_SIZE) & MAPPED) {
+        if (BLOCK_SIZE(size) >= MMAP_THRESHOLD &&
+            (newptr = mm_remap((char*)p - SIZE_T_SIZE, BLOCK_SIZE(size))) != NULL)
+            return newptr;
+    } else if (size > SLAB_MAX && mm_resize((char*)p - SIZE_T_SIZE, BLOCK_SIZE(size))) {
+        return p;
+    }
 
     newptr = mm_malloc(size);
     if (newptr == NULL)
         return NULL;
-    copySize = SIZE((char*)oldptr - SIZE_T_SIZE);
+    copySize = mm_usable_size(oldptr);
     if (size < copySize)
         copySize = size;
     memcpy(newptr, oldptr, copySize);
@@ -128,102 +315,510 @@ void* mm_realloc(void* p, size_t size) {
     return newptr;
 }
 
-static void* mm_malloc_new(size_t size) {
-    int newsize = ALIGN(size + 2 * SIZE_T_SIZE);
-    void* p = mem_sbrk(newsize);
-    if (p == (void*)-1)
+/*
+ * heap_alloc - a heap block of newsize bytes: a quick-listed one of that
+ *     size, else a fit from the bins, else one carved from the wilderness
+ *     after the quick lists are coalesced. Caller holds heap_lock.
+ */
+static void* heap_alloc(size_t newsize) {
+    void* p;
+
+    if ((p = quick_take(newsize)) != NULL || (p = mm_malloc_old(newsize)) != NULL)
+        return p;
+    if (quick_count > 0) {
+        quick_flush();
+        if ((p = mm_malloc_old(newsize)) != NULL)
+            return p;
+    }
+    return mm_malloc_new(newsize);
+}
+
+/* mm_remap - resize the mapped block p, possibly moving it, or NULL */
+static void* mm_remap(char* p, size_t newsize) {
+    newsize = PAGE_ROUND(newsize);
+    pthread_mutex_lock(&heap_lock);
+    p = mem_remap(p, SIZE(p), newsize);
+    pthread_mutex_unlock(&heap_lock);
+    if (p == NULL)
+        return NULL;
+    *HEADER(p) = newsize | ALLOC | MAPPED;
+    return p + SIZE_T_SIZE;
+}
+
+#if MEM_MMAP
+/* mm_map - a block of newsize bytes in a mapping of its own, or NULL */
+static void* mm_map(size_t newsize) {
+    char* p;
+
+    newsize = PAGE_ROUND(newsize);
+    pthread_mutex_lock(&heap_lock);
+    p = mem_map(newsize);
+    pthread_mutex_unlock(&heap_lock);
+    if (p == NULL)
+        return NULL;
+    *HEADER(p) = newsize | ALLOC | MAPPED;
+    return p + SIZE_T_SIZE;
+}
+
+/*
+ * mm_trim - give all but CHUNK_SIZE of the free top block p back, or as
+ *     much of it as one mem_sbrk call takes
+ */
+static void mm_trim(char* p) {
+    size_t size = SIZE(p);
+    size_t cut = size - CHUNK_SIZE;
+
+    if (cut > INT_MAX)
+        cut = INT_MAX & ~(CHUNK_SIZE - 1);
+    list_remove(p);
+    mem_sbrk(-(int)cut);
+    *HEADER(p + size - cut) = ALLOC;
+    mark_free(p, size - cut);
+}
+#endif
+
+/* quick_put - defer freeing heap block p; caller holds heap_lock */
+static void quick_put(void* p) {
+    size_t idx = SIZE(p) / ALIGNMENT;
+
+    if (!ALLOCATED(p))
+        return;
+    *NEXT(p) = quick[idx];
+    quick[idx] = p;
+    if (++quick_count > QUICK_LIMIT)
+        quick_flush();
+}
+
+static void* quick_take(size_t size) {
+    ptr p;
+
+    if (size > QUICK_MAX || (p = quick[size / ALIGNMENT]) == NULL)
         return NULL;
-    else {
-        *HEADER(p) = newsize | 1;
-        *FOOTER(p) = newsize | 1;
-        return (void*)((char*)p + SIZE_T_SIZE);
+    quick[size / ALIGNMENT] = *NEXT(p);
+    quick_count--;
+    return p;
+}
+
+/* quick_flush - free and coalesce every quick-listed block */
+static void quick_flush(void) {
+    ptr p;
+
+    for (size_t i = 0; i <= QUICK_MAX / ALIGNMENT; i++) {
+        while ((p = quick[i]) != NULL) {
+            quick[i] = *NEXT(p);
+            mm_free_block(p);
+        }
     }
+    quick_count = 0;
 }
 
-static void* mm_malloc_old(size_t size) {
-    ptr p, head;
-    size_t block_size, left_size;
-    size_t newsize = ALIGN(size + 2 * SIZE_T_SIZE);
+/*
+ * mm_resize - make the allocated heap block p span newsize bytes without
+ *     moving it, taking in a free right neighbor and, for the last block,
+ *     extending the heap. Returns 0 if it cannot.
+ */
+static int mm_resize(char* p, size_t newsize) {
+    char* next;
+    size_t total;
 
-    for (int idx = find_list_index(newsize); idx < NUM_LISTS; idx++) {
-        head = root[idx];
-        for (p = *NEXT(head); p != head; p = *NEXT(p)) {
-            block_size = SIZE(p);
-            if (!ALLOCATED(p) && (block_size >= newsize)) {
-                list_remove(p);
-                left_size = block_size - newsize;
-                if (left_size > ALIGN(2 * SIZE_T_SIZE + 2 * PTR_SIZE)) {
-                    *HEADER(p) = newsize | 1;
-                    *FOOTER(p) = newsize | 1;
-                    // p points to the left space
-                    ptr left = (char*)p + newsize;
-                    *HEADER(left) = left_size;
-                    *FOOTER(left) = left_size;
-                    list_push_front(left);
-                } else {
-                    *HEADER(p) = block_size | 1;
-                    *FOOTER(p) = block_size | 1;
-                }
-                return (void*)((char*)p + SIZE_T_SIZE);
-            }
+    pthread_mutex_lock(&heap_lock);
+    next = NEXT_BLOCK(p);
+    total = SIZE(p) + (ALLOCATED(next) ? 0 : SIZE(next));
+    if (total < newsize) {
+        // only the epilogue has size 0; mem_sbrk takes an int
+        if (SIZE(p + total) != 0 || newsize - total > INT_MAX || mem_sbrk(newsize - total) == (void*)-1) {
+            pthread_mutex_unlock(&heap_lock);
+            return 0;
         }
+        if (!ALLOCATED(next))
+            list_remove(next);
+        *HEADER(p) = newsize | ALLOC | PREV_IS_FREE(p);
+        *HEADER(p + newsize) = ALLOC;
+    } else {
+        if (!ALLOCATED(next))
+            list_remove(next);
+        place(p, total, newsize);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return 1;
+}
+
+/*
+ * place - the allocated block p now spans total bytes; keep newsize of
+ *     them and free the rest if it is big enough to be a block
+ */
+static void place(char* p, size_t total, size_t newsize) {
+    size_t prev = PREV_IS_FREE(p);
+
+    if (total - newsize >= MIN_BLOCK) {
+        *HEADER(p) = newsize | ALLOC | prev;
+        *HEADER(p + newsize) = (total - newsize) | ALLOC;
+        mm_free_block(p + newsize);
+    } else {
+        *HEADER(p) = total | ALLOC | prev;
+        *HEADER(p + total) &= ~PREV_FREE;
+    }
+}
+
+/*
+ * mm_free_block - return block p to the free lists, merging it with free
+ *     neighbors. Caller holds heap_lock.
+ */
+static void mm_free_block(void* p) {
+    if (!ALLOCATED(p))
+        return;
+
+    size_t block_size = SIZE(p);
+    char* next = NEXT_BLOCK(p);
+    if (PREV_IS_FREE(p)) {
+        // merge front
+        size_t front_block_size = SIZE((char*)p - SIZE_T_SIZE);
+        p = (char*)p - front_block_size;
+        list_remove(p);
+        block_size += front_block_size;
+    }
+    if (!ALLOCATED(next)) {
+        // merge back; the epilogue stops this at the heap end
+        list_remove(next);
+        block_size += SIZE(next);
     }
+    mark_free(p, block_size);
+#if MEM_MMAP
+    if (block_size >= TRIM_THRESHOLD && SIZE((char*)p + block_size) == 0)
+        mm_trim(p);
+#endif
+}
+
+/*
+ * mark_free - make [p, p + size) a free block whose left neighbor is
+ *     allocated, and tell the right neighbor
+ */
+static void mark_free(void* p, size_t size) {
+    *HEADER(p) = size;
+    *FOOTER(p) = size;
+    *HEADER(NEXT_BLOCK(p)) |= PREV_FREE;
+    list_push_front(p);
+}
+
+/* mm_usable_size - payload bytes of the allocated block at p */
+static size_t mm_usable_size(void* p) {
+    slab_t* s = slab_of(p);
+
+    return s ? class_size[s->cls] : SIZE((char*)p - SIZE_T_SIZE) - SIZE_T_SIZE;
+}
+
+/*
+ * mm_malloc_new - carve a block of newsize bytes from the wilderness,
+ *     growing the heap first if it is too small; the growth is shared
+ *     with the wilderness. The heap grows by at least CHUNK_SIZE, or just
+ *     the shortfall if that much is not available. Caller holds heap_lock.
+ */
+static void* mm_malloc_new(size_t newsize) {
+    char* top = (char*)mem_heap_hi() + 1 - SIZE_T_SIZE; // the epilogue
+    char* p = PREV_IS_FREE(top) ? top - SIZE(top - SIZE_T_SIZE) : top;
+    /* find_fit rounds up, so it misses a wilderness in the request's own bin */
+    size_t need = newsize > (size_t)(top - p) ? newsize - (top - p) : 0;
+    size_t grow = need == 0 ? 0 : need < CHUNK_SIZE ? CHUNK_SIZE : need;
 
-    return NULL;
+    if (need > INT_MAX) // more than mem_sbrk can take
+        return NULL;
+    if (grow > 0 && mem_sbrk(grow) == (void*)-1 && (grow == need || mem_sbrk(grow = need) == (void*)-1))
+        return NULL;
+    if (p < top)
+        list_remove(p);
+    *HEADER(p) = (top - p + grow) | ALLOC;
+    *HEADER(top + grow) = ALLOC;
+    place(p, top - p + grow, newsize);
+    return p;
 }
 
-static void* find_list(size_t size) {
-    int index = find_list_index(size);
-    if (index < 0 || index >= NUM_LISTS)
+/*
+ * mm_malloc_old - take a free block of at least newsize bytes out of the
+ *     bins, splitting off the rest, or NULL. Caller holds heap_lock.
+ */
+static void* mm_malloc_old(size_t newsize) {
+    ptr p;
+
+    if ((p = find_fit(newsize)) == NULL)
         return NULL;
-    return root[index];
-}
-
-static int find_list_index(size_t size) {
-    if (size <= 0)
-        return NUM_LISTS;
-    else if (size <= 16)
-        return 0;
-    else if (size <= 32)
-        return 1;
-    else if (size <= 64)
-        return 2;
+    list_remove(p);
+    place(p, SIZE(p), newsize);
+    return p;
+}
+
+/*
+ * find_fit - a free block of at least size bytes: the first block of the
+ *     smallest non-empty bin whose blocks all fit. Level 0 bins hold one
+ *     size each; above, size is rounded up to the next bin so that the
+ *     bin it maps to starts at or above it.
+ */
+static void* find_fit(size_t size) {
+    unsigned map;
+    int fl, sl;
+
+    if (size >= (1 << FL_SHIFT))
+        size += ((size_t)1 << (63 - __builtin_clzl(size) - SL_LOG)) - 1;
+    bin_index(size, &fl, &sl);
+    map = sl_bitmap[fl] & (~0U << sl);
+    if (map == 0) {
+        map = fl + 1 < FL_COUNT ? fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (map == 0)
+            return NULL;
+        fl = __builtin_ctz(map);
+        map = sl_bitmap[fl];
+    }
+    return bins[fl][__builtin_ctz(map)];
+}
+
+/* bin_index - the bin of free blocks of size bytes */
+static void bin_index(size_t size, int* fl, int* sl) {
+    if (size < (1 << FL_SHIFT)) {
+        *fl = 0;
+        *sl = size / ALIGNMENT;
+    } else {
+        int f = 63 - __builtin_clzl(size);
+        *fl = f - FL_SHIFT + 1;
+        *sl = (size >> (f - SL_LOG)) ^ SL_COUNT;
+    }
+}
+
+/* size_class - the slab class for a request of 1 to SLAB_MAX bytes */
+static int size_class(size_t size) {
+    if (size <= 64)
+        return (size - 1) / 8;
     else if (size <= 128)
-        return 3;
-    else if (size <= 256)
-        return 4;
-    else if (size <= 512)
-        return 5;
-    else if (size <= 1024)
-        return 6;
-    else if (size <= 2048)
-        return 7;
-    else if (size <= 4096)
-        return 8;
+        return 8 + (size - 65) / 16;
     else
-        return 9;
+        return 12 + (size - 129) / 32;
+}
+
+/* slab_of - the slab holding p, or NULL if p is a heap block */
+static slab_t* slab_of(void* p) {
+    size_t page = ((uintptr_t)p - page_base) / SLAB_SIZE;
+
+    if (page >= SLAB_PAGES || !slab_pages[page])
+        return NULL;
+    return (slab_t*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
 }
 
-static void* list_init() {
-    void* p = (char*)mm_malloc_new(2 * PTR_SIZE) - SIZE_T_SIZE;
-    *PREV(p) = p;
-    *NEXT(p) = p;
+/*
+ * slab_alloc - take an object of class cls, starting a new slab if no
+ *     slab of the class has room. Caller holds heap_lock.
+ */
+static void* slab_alloc(int cls) {
+    slab_t* s = partial[cls];
+    void* p;
+
+    if (s == NULL && (s = slab_new(cls)) == NULL)
+        return NULL;
+    if ((p = s->free) != NULL) {
+        s->free = *(ptr*)p;
+    } else {
+        p = s->fresh;
+        s->fresh += class_size[cls];
+    }
+    if (++s->used == s->count)
+        slab_unlink(s);
     return p;
 }
 
+/*
+ * slab_free - put object p back in slab s. An empty slab goes back to the
+ *     heap unless it is the last one of its class with room, which is kept
+ *     so that alternating malloc/free does not churn slabs. Caller holds
+ *     heap_lock.
+ */
+static void slab_free(slab_t* s, void* p) {
+    *(ptr*)p = s->free;
+    s->free = p;
+    if (s->used-- == s->count)
+        slab_link(s);
+    if (s->used == 0 && (s->prev || s->next)) {
+        slab_unlink(s);
+        slab_pages[((uintptr_t)s - page_base) / SLAB_SIZE] = 0;
+        mm_free_block(s);
+    }
+}
+
+static slab_t* slab_new(int cls) {
+    slab_t* s;
+
+    if ((s = slab_page()) == NULL)
+        return NULL;
+    s->cls = cls;
+    s->used = 0;
+    s->count = (SLAB_SIZE - SLAB_HEADER) / class_size[cls];
+    s->free = NULL;
+    s->fresh = (char*)s + SLAB_HEADER;
+    slab_pages[((uintptr_t)s - page_base) / SLAB_SIZE] = 1;
+    slab_link(s);
+    return s;
+}
+
+/*
+ * slab_page - an allocated heap block of SLAB_SIZE bytes aligned to
+ *     SLAB_SIZE, cut from a free block if one has such a range, otherwise
+ *     from the top of the heap. Caller holds heap_lock.
+ */
+static void* slab_page(void) {
+    ptr p;
+    char *a, *b, *top;
+    int fl, sl;
+
+    /* Blocks below 2 * SLAB_SIZE, all on one first level, may hold an aligned page */
+    bin_index(SLAB_SIZE, &fl, &sl);
+    for (sl = 0; sl < SL_COUNT; sl++) {
+        for (p = bins[fl][sl]; p != NULL; p = *NEXT(p)) {
+            if ((a = slab_fit(p, (char*)p + SIZE(p))) != NULL) {
+                list_remove(p);
+                return slab_carve(p, a, (char*)p + SIZE(p));
+            }
+        }
+    }
+    /* and larger ones always do */
+    if ((p = find_fit(2 * SLAB_SIZE)) != NULL) {
+        list_remove(p);
+        return slab_carve(p, (char*)SLAB_ROUND(p), (char*)p + SIZE(p));
+    }
+
+    top = (char*)mem_heap_hi() + 1 - SIZE_T_SIZE; // the epilogue
+    b = PREV_IS_FREE(top) ? top - SIZE(top - SIZE_T_SIZE) : top;
+    a = (char*)SLAB_ROUND(b);
+    if (mem_sbrk(a + SLAB_SIZE - top) == (void*)-1)
+        return NULL;
+    if (b < top)
+        list_remove(b);
+    *HEADER(a + SLAB_SIZE) = ALLOC;
+    return slab_carve(b, a, a + SLAB_SIZE);
+}
+
+/* slab_fit - where a slab fits in the free range [b, end), or NULL */
+static char* slab_fit(char* b, char* end) {
+    char* a = (char*)SLAB_ROUND(b);
+
+    return a + SLAB_SIZE <= end ? a : NULL;
+}
+
+/*
+ * slab_carve - make a slab block at a out of the free range [b, end),
+ *     which is on no list, and free what is left on either side
+ */
+static void* slab_carve(char* b, char* a, char* end) {
+    char* c = a + SLAB_SIZE;
+
+    *HEADER(a) = SLAB_SIZE | ALLOC;
+    if (a > b)
+        mark_free(b, a - b);
+    if (end > c)
+        mark_free(c, end - c);
+    else
+        *HEADER(c) &= ~PREV_FREE;
+    return a;
+}
+
+static void slab_link(slab_t* s) {
+    s->prev = NULL;
+    s->next = partial[s->cls];
+    if (s->next)
+        s->next->prev = s;
+    partial[s->cls] = s;
+}
+
+static void slab_unlink(slab_t* s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        partial[s->cls] = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+/* tcache_get - the calling thread's cache, emptied if mm_init ran since */
+static tcache_t* tcache_get(void) {
+    tcache_t* tc = &tcache;
+    unsigned gen = __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE);
+
+    if (tc->gen != gen) {
+        memset(tc, 0, sizeof(*tc));
+        tc->gen = gen;
+        pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+/* tcache_refill - move up to TCACHE_BATCH objects of class idx into its bin */
+static void tcache_refill(tcache_t* tc, int idx) {
+    ptr p;
+
+    pthread_mutex_lock(&heap_lock);
+    for (int i = 0; i < TCACHE_BATCH && (p = slab_alloc(idx)) != NULL; i++) {
+        *(ptr*)p = tc->bins[idx];
+        tc->bins[idx] = p;
+        tc->counts[idx]++;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* tcache_flush - give up to n objects of bin idx back to their slabs */
+static void tcache_flush(tcache_t* tc, int idx, int n) {
+    ptr p;
+
+    pthread_mutex_lock(&heap_lock);
+    while (n-- > 0 && (p = tc->bins[idx]) != NULL) {
+        tc->bins[idx] = *(ptr*)p;
+        tc->counts[idx]--;
+        slab_free(slab_of(p), p);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* tcache_destroy - thread exit: flush the whole cache unless it is stale */
+static void tcache_destroy(void* arg) {
+    tcache_t* tc = arg;
+
+    if (tc->gen != __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE))
+        return;
+    for (int i = 0; i < NUM_CLASSES; i++)
+        tcache_flush(tc, i, tc->counts[i]);
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/* Fragments smaller than MIN_BLOCK are never in a bin */
 static void* list_push_front(void* p) {
-    void* head = find_list(SIZE(p));
-    *PREV(p) = head;
-    *NEXT(p) = *NEXT(head);
-    *NEXT(*PREV(p)) = p;
-    *PREV(*NEXT(p)) = p;
+    int fl, sl;
+
+    if (SIZE(p) < MIN_BLOCK)
+        return p;
+    bin_index(SIZE(p), &fl, &sl);
+    *PREV(p) = NULL;
+    *NEXT(p) = bins[fl][sl];
+    if (*NEXT(p) != NULL)
+        *PREV(*NEXT(p)) = p;
+    bins[fl][sl] = p;
+    sl_bitmap[fl] |= 1U << sl;
+    fl_bitmap |= 1U << fl;
     return p;
 }
 
 static void* list_remove(void* p) {
-    *NEXT(*PREV(p)) = *NEXT(p);
-    *PREV(*NEXT(p)) = *PREV(p);
+    int fl, sl;
+
+    if (SIZE(p) < MIN_BLOCK)
+        return p;
+    if (*PREV(p) != NULL) {
+        *NEXT(*PREV(p)) = *NEXT(p);
+    } else {
+        bin_index(SIZE(p), &fl, &sl);
+        if ((bins[fl][sl] = *NEXT(p)) == NULL && (sl_bitmap[fl] &= ~(1U << sl)) == 0)
+            fl_bitmap &= ~(1U << fl);
+    }
+    if (*NEXT(p) != NULL)
+        *PREV(*NEXT(p)) = *PREV(p);
     *NEXT(p) = NULL;
     *PREV(p) = NULL;
     return p;
-}
\ No newline at end of file
+}
@@ -0,0 +1,185 @@
+/*
+ * mtrace.c - an LD_PRELOAD library that records the malloc, calloc,
+ *     realloc and free calls of a running program
+ *
+ *     unix> MTRACE_DIR=/tmp/cap LD_PRELOAD=./libmtrace.so program
+ *     unix> mtrace2rep program.rep /tmp/cap/mtrace.<pid>.*
+ *
+ * Each thread appends to a buffer of its own and writes it to its own
+ * file (see mtrace.h) when it fills and when the thread exits, so the
+ * calls being traced never contend on a lock. The real allocator is
+ * reached through glibc's __libc_* entry points rather than dlsym, which
+ * itself allocates. Buffers of threads still running when the process
+ * exits are lost, as are the calls of memalign and friends.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mtrace.h"
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+/* A thread's capture state */
+typedef struct {
+    mtrace_rec_t* recs; /* MTRACE_BUF_RECS records, mapped on first use */
+    int n;              /* records buffered */
+    int fd;             /* its mtrace.<pid>.<tid> file, or -1 */
+} mtbuf_t;
+
+static TLS mtbuf_t tbuf = {NULL, 0, -1};
+static TLS int busy; /* set while recording, so nested calls pass through */
+static pthread_key_t flush_key;
+static const char* dir = ".";
+
+static uint64_t now(void);
+static void record(int type, void* ptr, void* old, size_t size, uint64_t start);
+static void flush(mtbuf_t* b);
+static void thread_exit(void* arg);
+static void after_fork(void);
+
+__attribute__((constructor)) static void mtrace_init(void) {
+    char* d = getenv("MTRACE_DIR");
+
+    if (d != NULL && *d != '\0')
+        dir = d;
+    pthread_key_create(&flush_key, thread_exit);
+    pthread_atfork(NULL, NULL, after_fork);
+}
+
+/* The main thread exits without running key destructors */
+__attribute__((destructor)) static void mtrace_fini(void) {
+    thread_exit(&tbuf);
+}
+
+void* malloc(size_t size) {
+    void* p = __libc_malloc(size);
+
+    record(MT_MALLOC, p, NULL, size, 0);
+    return p;
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    void* p = __libc_calloc(nmemb, size);
+
+    record(MT_CALLOC, p, NULL, (nmemb && size > SIZE_MAX / nmemb) ? SIZE_MAX : nmemb * size, 0);
+    return p;
+}
+
+/*
+ * ptr may be released and handed to another thread before the call
+ * returns, so its release is stamped before the call
+ */
+void* realloc(void* ptr, size_t size) {
+    uint64_t start = now();
+    void* p = __libc_realloc(ptr, size);
+
+    record(MT_REALLOC, p, ptr, size, start);
+    return p;
+}
+
+/* Recorded before the call, so that it precedes any reuse of ptr */
+void free(void* ptr) {
+    if (ptr != NULL)
+        record(MT_FREE, ptr, NULL, 0, 0);
+    __libc_free(ptr);
+}
+
+static uint64_t now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Buffer a call; start is when it was made, or 0 for now */
+static void record(int type, void* ptr, void* old, size_t size, uint64_t start) {
+    mtbuf_t* b = &tbuf;
+    mtrace_rec_t* r;
+    int saved_errno = errno;
+
+    if (busy)
+        return;
+    busy = 1;
+    if (b->recs == NULL) {
+        b->recs = mmap(NULL, MTRACE_BUF_RECS * sizeof(mtrace_rec_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b->recs == MAP_FAILED) {
+            b->recs = NULL;
+            goto out;
+        }
+        pthread_setspecific(flush_key, b);
+    }
+    r = &b->recs[b->n++];
+    r->ns = now();
+    r->start = start ? start : r->ns;
+    r->ptr = (uintptr_t)ptr;
+    r->old = (uintptr_t)old;
+    r->size = (size > UINT32_MAX) ? UINT32_MAX : size;
+    r->type = type;
+    if (b->n == MTRACE_BUF_RECS)
+        flush(b);
+out:
+    busy = 0;
+    errno = saved_errno;
+}
+
+/* Write out the buffered records, opening the thread's file on first use */
+static void flush(mtbuf_t* b) {
+    char path[PATH_MAX];
+    char* p = (char*)b->recs;
+    size_t left = b->n * sizeof(mtrace_rec_t);
+    ssize_t n;
+
+    b->n = 0;
+    if (b->fd < 0) {
+        snprintf(path, sizeof(path), "%s/mtrace.%d.%ld", dir, (int)getpid(), (long)syscall(SYS_gettid));
+        if ((b->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+            return;
+    }
+    while (left > 0) {
+        if ((n = write(b->fd, p, left)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
+
+static void thread_exit(void* arg) {
+    mtbuf_t* b = arg;
+
+    if (b->recs == NULL)
+        return;
+    busy = 1;
+    flush(b);
+    munmap(b->recs, MTRACE_BUF_RECS * sizeof(mtrace_rec_t));
+    b->recs = NULL;
+    if (b->fd >= 0)
+        close(b->fd);
+    b->fd = -1;
+    busy = 0;
+}
+
+/* The child starts a file of its own rather than repeating the parent's */
+static void after_fork(void) {
+    tbuf.n = 0;
+    if (tbuf.fd >= 0)
+        close(tbuf.fd);
+    tbuf.fd = -1;
+}
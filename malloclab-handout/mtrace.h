@@ -0,0 +1,22 @@
+/*
+ * mtrace.h - the capture format of libmtrace.so
+ *
+ * Each thread of a traced process writes its calls to a file of its own,
+ * mtrace.<pid>.<tid>, as an array of mtrace_rec_t in the order it made
+ * them. mtrace2rep merges the files of a run by timestamp into a .rep
+ * trace for mdriver.
+ */
+#include <stdint.h>
+
+#define MTRACE_BUF_RECS 65536 /* records a thread buffers between writes */
+
+enum { MT_MALLOC, MT_CALLOC, MT_REALLOC, MT_FREE };
+
+typedef struct {
+    uint64_t ns;    /* CLOCK_MONOTONIC time the call returned; for free, made */
+    uint64_t start; /* time the call was made, before old was released */
+    uint64_t ptr;   /* block returned, or the one freed */
+    uint64_t old;  /* block passed to realloc */
+    uint32_t size; /* bytes requested, saturated at UINT32_MAX */
+    uint32_t type; /* MT_MALLOC ... MT_FREE */
+} mtrace_rec_t;
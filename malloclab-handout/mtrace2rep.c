@@ -0,0 +1,321 @@
+/*
+ * mtrace2rep.c - turn the capture files of libmtrace.so into a trace for
+ *     mdriver
+ *
+ * usage: mtrace2rep <out> <mtrace.pid.tid>...
+ *
+ * The calls of all threads are merged by timestamp and replayed as one
+ * sequence, with blocks numbered in the order they were allocated. The
+ * trace is written in the text format if out ends in ".rep" and in the
+ * binary format of trace.h otherwise. A realloc gives up its old block
+ * when the call is made, since the allocator may hand the address to
+ * another thread before the call returns, and takes the new one when
+ * it returns. Frees of blocks allocated before tracing began are
+ * dropped, and a block the allocator returns while still live in the
+ * trace (its free was lost) is freed first.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mtrace.h"
+#include "trace.h"
+
+/*
+ * A record with its place in the capture, for a stable merge. A realloc
+ * of a block is two events: its start, releasing the old block, and its
+ * end.
+ */
+typedef struct {
+    mtrace_rec_t rec;
+    uint64_t ns; /* rec.start for a start, rec.ns otherwise */
+    int file;
+    int seq;
+    int start;
+} event_t;
+
+/* Maps the address of each live block to its id; linear probing */
+typedef struct {
+    uint64_t* keys; /* 0 marks an empty slot */
+    int* ids;
+    size_t mask;
+    size_t count;
+} ptrmap_t;
+
+static event_t* events;
+static size_t num_events, max_events;
+static traceop_t* ops;
+static int num_ops, max_ops;
+static int* sizes;   /* request size of each live id */
+static int* pending; /* per file, the id its realloc in flight released, or -1 */
+static int num_ids, max_ids;
+static long live, peak;
+
+static void die(char* what) {
+    fprintf(stderr, "mtrace2rep: %s\n", what);
+    exit(1);
+}
+
+static void* grow(void* p, int* max, size_t elem) {
+    *max = *max ? 2 * *max : 1024;
+    if ((p = realloc(p, *max * elem)) == NULL)
+        die("out of memory");
+    return p;
+}
+
+static void add_event(mtrace_rec_t* rec, int file, int seq, int start) {
+    event_t* e = &events[num_events++];
+
+    e->rec = *rec;
+    e->ns = start ? rec->start : rec->ns;
+    e->file = file;
+    e->seq = seq;
+    e->start = start;
+}
+
+static void read_capture(char* path, int file) {
+    struct stat sbuf;
+    mtrace_rec_t* recs;
+    size_t i, n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sbuf) < 0) {
+        perror(path);
+        exit(1);
+    }
+    n = sbuf.st_size / sizeof(mtrace_rec_t);
+    if (n == 0) {
+        close(fd);
+        return;
+    }
+    if ((recs = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    if (num_events + 2 * n > max_events) {
+        max_events = 2 * (num_events + 2 * n);
+        if ((events = realloc(events, max_events * sizeof(event_t))) == NULL)
+            die("out of memory");
+    }
+    for (i = 0; i < n; i++) {
+        if (recs[i].type == MT_REALLOC && recs[i].old != 0)
+            add_event(&recs[i], file, i, 1);
+        add_event(&recs[i], file, i, 0);
+    }
+    munmap(recs, sbuf.st_size);
+    close(fd);
+}
+
+static int by_time(const void* a, const void* b) {
+    const event_t *x = a, *y = b;
+
+    if (x->ns != y->ns)
+        return (x->ns < y->ns) ? -1 : 1;
+    if (x->file != y->file)
+        return x->file - y->file;
+    if (x->seq != y->seq)
+        return x->seq - y->seq;
+    return y->start - x->start;
+}
+
+static void map_init(ptrmap_t* m, size_t slots) {
+    m->mask = slots - 1;
+    m->count = 0;
+    if ((m->keys = calloc(slots, sizeof(uint64_t))) == NULL ||
+        (m->ids = malloc(slots * sizeof(int))) == NULL)
+        die("out of memory");
+}
+
+static size_t slot_of(ptrmap_t* m, uint64_t key) {
+    size_t i = (key * 0x9e3779b97f4a7c15ULL >> 17) & m->mask;
+
+    while (m->keys[i] != 0 && m->keys[i] != key)
+        i = (i + 1) & m->mask;
+    return i;
+}
+
+/* Returns the id of the live block at key, or -1 */
+static int map_get(ptrmap_t* m, uint64_t key) {
+    size_t i = slot_of(m, key);
+
+    return m->keys[i] ? m->ids[i] : -1;
+}
+
+static void map_put(ptrmap_t* m, uint64_t key, int id) {
+    size_t i;
+
+    if (2 * (m->count + 1) > m->mask + 1) {
+        ptrmap_t old = *m;
+
+        map_init(m, 2 * (old.mask + 1));
+        for (i = 0; i <= old.mask; i++) {
+            if (old.keys[i] != 0)
+                map_put(m, old.keys[i], old.ids[i]);
+        }
+        free(old.keys);
+        free(old.ids);
+    }
+    i = slot_of(m, key);
+    if (m->keys[i] == 0)
+        m->count++;
+    m->keys[i] = key;
+    m->ids[i] = id;
+}
+
+/* Removes key, shifting later entries of its probe run back into place */
+static void map_del(ptrmap_t* m, uint64_t key) {
+    size_t i = slot_of(m, key), j, home;
+
+    if (m->keys[i] == 0)
+        return;
+    m->keys[i] = 0;
+    m->count--;
+    for (j = (i + 1) & m->mask; m->keys[j] != 0; j = (j + 1) & m->mask) {
+        home = (m->keys[j] * 0x9e3779b97f4a7c15ULL >> 17) & m->mask;
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->ids[i] = m->ids[j];
+            m->keys[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static void emit(int type, int id, int size) {
+    if (num_ops == max_ops)
+        ops = grow(ops, &max_ops, sizeof(traceop_t));
+    ops[num_ops].type = type;
+    ops[num_ops].index = id;
+    ops[num_ops].size = size;
+    num_ops++;
+    if (type != FREE) {
+        live += size - ((type == REALLOC) ? sizes[id] : 0);
+        sizes[id] = size;
+        if (live > peak)
+            peak = live;
+    } else {
+        live -= sizes[id];
+    }
+}
+
+/* Free whatever block the trace still has at ptr */
+static void drop(ptrmap_t* m, uint64_t ptr) {
+    int id = map_get(m, ptr);
+
+    if (id >= 0) {
+        emit(FREE, id, 0);
+        map_del(m, ptr);
+    }
+}
+
+static void alloc(ptrmap_t* m, uint64_t ptr, int size) {
+    drop(m, ptr);
+    if (num_ids == max_ids)
+        sizes = grow(sizes, &max_ids, sizeof(int));
+    emit(ALLOC, num_ids, size);
+    map_put(m, ptr, num_ids++);
+}
+
+static void write_trace(char* path) {
+    size_t len = strlen(path);
+    trace_hdr_t hdr;
+    FILE* out;
+    int i;
+
+    if ((out = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.sugg_heapsize = (peak > INT_MAX) ? INT_MAX : peak;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.weight = 1;
+    if (len < 4 || strcmp(path + len - 4, ".rep") != 0) {
+        fwrite(&hdr, sizeof(hdr), 1, out);
+        fwrite(ops, sizeof(traceop_t), num_ops, out);
+    } else {
+        fprintf(out, "%d\n%d\n%d\n%d\n", hdr.sugg_heapsize, hdr.num_ids,
+                hdr.num_ops, hdr.weight);
+        for (i = 0; i < num_ops; i++) {
+            if (ops[i].type == FREE)
+                fprintf(out, "f %d\n", ops[i].index);
+            else
+                fprintf(out, "%c %d %d\n", (ops[i].type == ALLOC) ? 'a' : 'r',
+                        ops[i].index, ops[i].size);
+        }
+    }
+    if (ferror(out) || fclose(out) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    ptrmap_t map;
+    mtrace_rec_t* r;
+    size_t i, dropped = 0;
+    int id, size;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <out> <mtrace.pid.tid>...\n", argv[0]);
+        exit(1);
+    }
+    for (i = 2; i < argc; i++)
+        read_capture(argv[i], i);
+    qsort(events, num_events, sizeof(event_t), by_time);
+    map_init(&map, 1024);
+    if ((pending = malloc(argc * sizeof(int))) == NULL)
+        die("out of memory");
+
+    for (i = 0; i < num_events; i++) {
+        r = &events[i].rec;
+        size = (r->size == 0) ? 1 : (r->size > INT_MAX) ? INT_MAX : r->size;
+        switch (r->type) {
+            case MT_MALLOC:
+            case MT_CALLOC:
+                if (r->ptr != 0)
+                    alloc(&map, r->ptr, size);
+                break;
+            case MT_REALLOC:
+                if (r->old == 0) {
+                    if (r->ptr != 0)
+                        alloc(&map, r->ptr, size);
+                } else if (events[i].start) {
+                    /* A thread has one call in flight at a time */
+                    if ((pending[events[i].file] = map_get(&map, r->old)) >= 0)
+                        map_del(&map, r->old);
+                } else if ((id = pending[events[i].file]) < 0) {
+                    if (r->ptr != 0)
+                        alloc(&map, r->ptr, size);
+                } else if (r->ptr == 0) {
+                    if (r->size == 0) /* realloc(p, 0) frees p */
+                        emit(FREE, id, 0);
+                    else /* a failed realloc leaves p alone */
+                        map_put(&map, r->old, id);
+                } else {
+                    drop(&map, r->ptr);
+                    emit(REALLOC, id, size);
+                    map_put(&map, r->ptr, id);
+                }
+                break;
+            case MT_FREE:
+                if (map_get(&map, r->ptr) < 0)
+                    dropped++;
+                drop(&map, r->ptr);
+                break;
+            default:
+                die("bogus record type");
+        }
+    }
+    write_trace(argv[1]);
+    fprintf(stderr, "%zu calls, %d requests on %d blocks, %zu frees of untraced blocks dropped\n",
+            num_events, num_ops, num_ids, dropped);
+    return 0;
+}
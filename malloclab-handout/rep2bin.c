@@ -0,0 +1,80 @@
+/*
+ * rep2bin.c - convert a text trace (.rep) to the binary trace format in
+ *     trace.h, which mdriver maps instead of parsing
+ *
+ * usage: rep2bin <in.rep> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void die(char* path, char* what) {
+    fprintf(stderr, "rep2bin: %s: %s\n", path, what);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    FILE *in, *out;
+    trace_hdr_t hdr;
+    traceop_t op;
+    char type[2];
+    int max_index = -1, n = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die(argv[1], "cannot open");
+    if ((out = fopen(argv[2], "w")) == NULL)
+        die(argv[2], "cannot create");
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+               &hdr.num_ops, &hdr.weight) != 4)
+        die(argv[1], "bad header");
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        die(argv[2], "write failed");
+
+    memset(&op, 0, sizeof(op));
+    while (fscanf(in, " %1s", type) == 1) {
+        op.size = 0;
+        switch (type[0]) {
+            case 'a':
+                op.type = ALLOC;
+                if (fscanf(in, "%d %d", &op.index, &op.size) != 2)
+                    die(argv[1], "bad alloc request");
+                break;
+            case 'r':
+                op.type = REALLOC;
+                if (fscanf(in, "%d %d", &op.index, &op.size) != 2)
+                    die(argv[1], "bad realloc request");
+                break;
+            case 'f':
+                op.type = FREE;
+                if (fscanf(in, "%d", &op.index) != 1)
+                    die(argv[1], "bad free request");
+                break;
+            default:
+                die(argv[1], "bogus request type");
+        }
+        if (op.index < 0 || op.index >= hdr.num_ids)
+            die(argv[1], "block id out of range");
+        if (op.size < 0)
+            die(argv[1], "negative request size");
+        if (op.index > max_index)
+            max_index = op.index;
+        if (fwrite(&op, sizeof(op), 1, out) != 1)
+            die(argv[2], "write failed");
+        n++;
+    }
+    if (n != hdr.num_ops || max_index != hdr.num_ids - 1)
+        die(argv[1], "request count does not match the header");
+    fclose(in);
+    if (fclose(out) != 0)
+        die(argv[2], "write failed");
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * trace.h - the binary trace format
+ *
+ * A binary trace is a trace_hdr_t followed by num_ops traceop_t records,
+ * in the byte order of the machine that wrote it, so that the driver can
+ * map the file and use the records in place. rep2bin converts text
+ * traces to this format.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    int index;                          /* index for free() to use later */
+    int size;                           /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Starts a binary trace; the same four numbers as a text trace header */
+typedef struct {
+    char magic[8]; /* TRACE_MAGIC, without the terminating NUL */
+    int32_t sugg_heapsize;
+    int32_t num_ids;
+    int32_t num_ops;
+    int32_t weight;
+} trace_hdr_t;
+
+_Static_assert(sizeof(traceop_t) == 12, "traceop_t must be fixed-width");
+_Static_assert(sizeof(trace_hdr_t) % sizeof(int) == 0, "records must stay aligned");
@@ -0,0 +1,364 @@
+/* $begin tinymain */
+/*
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content. Connections are handled
+ *     iteratively, or by a pool of worker threads if a thread count is
+ *     given on the command line.
+ *
+ * Updated 11/2019 droh
+ *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ */
+#include <sys/sendfile.h>
+
+#include "cgipool.h"
+#include "csapp.h"
+#include "fcache.h"
+
+typedef struct {
+    int *buf;    /* Buffer array */
+    int n;       /* Maximum number of slots */
+    int front;   /* buf[(front+1)%n] is first item */
+    int rear;    /* buf[rear%n] is last item */
+    sem_t mutex; /* Protects accesses to buf */
+    sem_t slots; /* Counts available slots */
+    sem_t items; /* Counts available items */
+} sbuf_t;
+
+void *thread(void *vargp);
+void *reaper(void *vargp);
+void doit(int fd);
+int read_requesthdrs(rio_t *rp);
+int parse_uri(char *uri, char *filename, char *cgiargs);
+void serve_static(int fd, char *filename, struct stat *sbuf);
+void send_static(int fd, fcache_entry *e);
+void get_filetype(char *filename, char *filetype);
+void serve_dynamic(int fd, char *filename, char *cgiargs);
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+static fcache fc;
+static cgi_pool cp;
+
+int main(int argc, char **argv) {
+    int listenfd, connfd, nthreads = 0;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    sbuf_t sbuf;
+    pthread_t tid;
+    sigset_t mask;
+
+    /* Check command line args */
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s <port> [threads]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 3) nthreads = atoi(argv[2]);
+
+    /* A client hanging up mid-response must not take the server down */
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* CGI children are collected by the reaper thread; no other thread sees SIGCHLD */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, reaper, NULL);
+
+    fcache_init(&fc);
+    cgipool_init(&cp);
+    listenfd = Open_listenfd(argv[1]);
+    if (nthreads > 0) {
+        sbuf_init(&sbuf, MAXBUF);
+        for (int i = 0; i < nthreads; i++) Pthread_create(&tid, NULL, thread, &sbuf);
+    }
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);  // line:netp:tiny:accept
+        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        if (nthreads > 0) {
+            sbuf_insert(&sbuf, connfd); /* Hand off to the worker pool */
+            continue;
+        }
+        doit(connfd);   // line:netp:tiny:doit
+        Close(connfd);  // line:netp:tiny:close
+    }
+}
+/* $end tinymain */
+
+void *thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    sbuf_t *sbuf = vargp;
+    while (1) {
+        int connfd = sbuf_remove(sbuf); /* Remove connfd from buf */
+        doit(connfd);                   /* Service client */
+        Close(connfd);
+    }
+}
+
+/*
+ * reaper - collect exited CGI children so that no request has to wait
+ *     for its CGI program
+ */
+void *reaper(void *vargp) {
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    while (1) {
+        sigwait(&mask, &sig);
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+    }
+}
+
+/*
+ * doit - handle one HTTP request/response transaction
+ */
+/* $begin doit */
+void doit(int fd) {
+    int is_static;
+    struct stat sbuf;
+    fcache_entry *e;
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    rio_t rio;
+
+    /* Read request line and headers */
+    Rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0)  // line:netp:doit:readrequest
+        return;
+    printf("%s", buf);
+    sscanf(buf, "%s %s %s", method, uri, version);  // line:netp:doit:parserequest
+    if (strcasecmp(method, "GET")) {                // line:netp:doit:beginrequesterr
+        clienterror(fd, method, "501", "Not Implemented", "Tiny does not implement this method");
+        return;
+    }                                 // line:netp:doit:endrequesterr
+    if (read_requesthdrs(&rio) < 0)  // line:netp:doit:readrequesthdrs
+        return;
+
+    /* Parse URI from GET request */
+    is_static = parse_uri(uri, filename, cgiargs);  // line:netp:doit:staticcheck
+    if (is_static && (e = fcache_get(&fc, filename))) {
+        send_static(fd, e); /* Hot file: descriptor and header are already cached */
+        fcache_put(&fc, e);
+        return;
+    }
+    if (stat(filename, &sbuf) < 0) {                // line:netp:doit:beginnotfound
+        clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
+        return;
+    }  // line:netp:doit:endnotfound
+
+    if (is_static) {                                                  /* Serve static content */
+        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {  // line:netp:doit:readable
+            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file");
+            return;
+        }
+        serve_static(fd, filename, &sbuf);                            // line:netp:doit:servestatic
+    } else {                                                          /* Serve dynamic content */
+        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {  // line:netp:doit:executable
+            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
+            return;
+        }
+        serve_dynamic(fd, filename, cgiargs);  // line:netp:doit:servedynamic
+    }
+}
+/* $end doit */
+
+/*
+ * read_requesthdrs - read HTTP request headers; returns -1 if the client
+ *     closed or reset the connection before the blank line ending them
+ */
+/* $begin read_requesthdrs */
+int read_requesthdrs(rio_t *rp) {
+    char buf[MAXLINE];
+
+    do {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0) return -1;
+        printf("%s", buf);
+    } while (strcmp(buf, "\r\n"));  // line:netp:readhdrs:checkterm
+    return 0;
+}
+/* $end read_requesthdrs */
+
+/*
+ * parse_uri - parse URI into filename and CGI args
+ *             return 0 if dynamic content, 1 if static
+ */
+/* $begin parse_uri */
+int parse_uri(char *uri, char *filename, char *cgiargs) {
+    char *ptr;
+
+    if (!strstr(uri, "cgi-bin")) { /* Static content */  // line:netp:parseuri:isstatic
+        strcpy(cgiargs, "");                             // line:netp:parseuri:clearcgi
+        strcpy(filename, ".");                           // line:netp:parseuri:beginconvert1
+        strcat(filename, uri);                           // line:netp:parseuri:endconvert1
+        if (uri[strlen(uri) - 1] == '/')                 // line:netp:parseuri:slashcheck
+            strcat(filename, "home.html");               // line:netp:parseuri:appenddefault
+        return 1;
+    } else { /* Dynamic content */  // line:netp:parseuri:isdynamic
+        ptr = index(uri, '?');      // line:netp:parseuri:beginextract
+        if (ptr) {
+            strcpy(cgiargs, ptr + 1);
+            *ptr = '\0';
+        } else
+            strcpy(cgiargs, "");  // line:netp:parseuri:endextract
+        strcpy(filename, ".");    // line:netp:parseuri:beginconvert2
+        strcat(filename, uri);    // line:netp:parseuri:endconvert2
+        return 0;
+    }
+}
+/* $end parse_uri */
+
+/*
+ * serve_static - copy a file back to the client, and remember its
+ *     descriptor and response header for the next request
+ */
+/* $begin serve_static */
+void serve_static(int fd, char *filename, struct stat *sbuf) {
+    int srcfd;
+    char filetype[MAXLINE], buf[MAXBUF];
+    fcache_entry *e;
+
+    /* Open first so the header describes the file actually sent */
+    srcfd = Open(filename, O_RDONLY, 0);  // line:netp:servestatic:open
+    if (fstat(srcfd, sbuf) < 0) unix_error("fstat error");
+
+    /* Render response headers */
+    get_filetype(filename, filetype);     // line:netp:servestatic:getfiletype
+    sprintf(buf, "HTTP/1.0 200 OK\r\n");  // line:netp:servestatic:beginserve
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Content-length: %d\r\n", (int)sbuf->st_size);
+    sprintf(buf + strlen(buf), "Content-type: %s\r\n\r\n", filetype);  // line:netp:servestatic:endserve
+
+    e = fcache_add(&fc, filename, srcfd, sbuf, buf);
+    send_static(fd, e);
+    fcache_put(&fc, e);
+}
+
+/*
+ * send_static - write a cached header, then the file body straight from
+ *     the page cache
+ */
+void send_static(int fd, fcache_entry *e) {
+    ssize_t n;
+    off_t offset = 0;
+
+    if (rio_writen(fd, e->header, e->header_len) < 0) return; /* The caller closes fd */
+    while (offset < e->size) {
+        if ((n = sendfile(fd, e->fd, &offset, e->size - offset)) <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break; /* Client went away or file shrank */
+        }
+    }
+}
+
+/*
+ * get_filetype - derive file type from file name
+ */
+void get_filetype(char *filename, char *filetype) {
+    if (strstr(filename, ".html"))
+        strcpy(filetype, "text/html");
+    else if (strstr(filename, ".gif"))
+        strcpy(filetype, "image/gif");
+    else if (strstr(filename, ".png"))
+        strcpy(filetype, "image/png");
+    else if (strstr(filename, ".jpg"))
+        strcpy(filetype, "image/jpeg");
+    else
+        strcpy(filetype, "text/plain");
+}
+/* $end serve_static */
+
+/*
+ * serve_dynamic - run a CGI program on behalf of the client
+ */
+/* $begin serve_dynamic */
+void serve_dynamic(int fd, char *filename, char *cgiargs) {
+    char buf[MAXLINE], *emptylist[] = {NULL};
+    sigset_t mask;
+
+    /* Return first part of HTTP response */
+    sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+    if (rio_writen(fd, buf, strlen(buf)) < 0) return;
+
+    /* Prefer a persistent worker; fall back to classic CGI */
+    if (cgipool_serve(&cp, filename, cgiargs, fd) == 0) return;
+
+    if (Fork() == 0) { /* Child */  // line:netp:servedynamic:fork
+        /* Real server would set all CGI vars here */
+        setenv("QUERY_STRING", cgiargs, 1);                          // line:netp:servedynamic:setenv
+        Dup2(fd, STDOUT_FILENO); /* Redirect stdout to client */     // line:netp:servedynamic:dup2
+        Sigemptyset(&mask);
+        Sigprocmask(SIG_SETMASK, &mask, NULL);
+        Execve(filename, emptylist, environ); /* Run CGI program */  // line:netp:servedynamic:execve
+    }
+    /* The child keeps the connection open until it exits; the reaper collects it */
+}
+/* $end serve_dynamic */
+
+/*
+ * clienterror - returns an error message to the client
+ */
+/* $begin clienterror */
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char status[MAXLINE], msg[MAXLINE], detail[MAXLINE];
+    struct iovec iov[7];
+
+    /* Format the variable parts of the HTTP response headers and body */
+    sprintf(status, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    sprintf(msg, "%s: %s\r\n", errnum, shortmsg);
+    sprintf(detail, "<p>%s: %s\r\n", longmsg, cause);
+
+    /* Send them with the constant parts in one system call */
+    char *frags[] = {status,
+                     "Content-type: text/html\r\n\r\n",
+                     "<html><title>Tiny Error</title>",
+                     "<body bgcolor="
+                     "ffffff"
+                     ">\r\n",
+                     msg,
+                     detail,
+                     "<hr><em>The Tiny Web server</em>\r\n"};
+    for (int i = 0; i < 7; i++) {
+        iov[i].iov_base = frags[i];
+        iov[i].iov_len = strlen(frags[i]);
+    }
+    rio_writev(fd, iov, 7); /* A client that went away just gets closed */
+}
+/* $end clienterror */
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;                  /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;   /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0); /* Initially, buf has 0 items */
+}
+
+/* Insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int item) {
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->buf[(++sp->rear) % (sp->n)] = item; /* Insert the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+
+/* Remove and return the first item from buffer sp */
+int sbuf_remove(sbuf_t *sp) {
+    int item;
+    P(&sp->items);                           /* Wait for available item */
+    P(&sp->mutex);                           /* Lock the buffer */
+    item = sp->buf[(++sp->front) % (sp->n)]; /* Remove the item */
+    V(&sp->mutex);                           /* Unlock the buffer */
+    V(&sp->slots);                           /* Announce available slot */
+    return item;
+}
@@ -0,0 +1,51 @@
+#include "arena.h"
+
+void arena_init(arena *a, size_t size) {
+    a->base = (char *)Malloc(size);
+    a->size = size;
+    a->used = 0;
+}
+
+void arena_deinit(arena *a) { Free(a->base); }
+
+/*
+ * arena_alloc - carve n bytes, aligned to ARENA_ALIGN, off the arena.
+ *     Returns NULL once the arena is exhausted.
+ */
+void *arena_alloc(arena *a, size_t n) {
+    size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (start > a->size || n > a->size - start) return NULL;
+    a->used = start + n;
+    return a->base + start;
+}
+
+/* arena_strndup - copy the n bytes at s into the arena as a string */
+char *arena_strndup(arena *a, const char *s, size_t n) {
+    char *p = (char *)arena_alloc(a, n + 1);
+
+    if (p) {
+        memcpy(p, s, n);
+        p[n] = '\0';
+    }
+    return p;
+}
+
+/* arena_printf - format into a string sized exactly for the result */
+char *arena_printf(arena *a, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    char *p;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !(p = (char *)arena_alloc(a, n + 1))) return NULL;
+    va_start(ap, fmt);
+    vsnprintf(p, n + 1, fmt, ap);
+    va_end(ap);
+    return p;
+}
+
+/* arena_reset - release every allocation in O(1) */
+void arena_reset(arena *a) { a->used = 0; }
@@ -0,0 +1,26 @@
+/*
+ * arena.h - bump-pointer allocator for request-scoped memory. Nothing is
+ *     freed on its own; arena_reset releases everything at once.
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+#define ARENA_SIZE (128 * 1024) /* Room for the worst-case request */
+#define ARENA_ALIGN 16
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} arena;
+
+void arena_init(arena *a, size_t size);
+void arena_deinit(arena *a);
+void *arena_alloc(arena *a, size_t n);
+char *arena_strndup(arena *a, const char *s, size_t n);
+char *arena_printf(arena *a, const char *fmt, ...);
+void arena_reset(arena *a);
+
+#endif /* __ARENA_H__ */
@@ -7,6 +7,8 @@
 static void cache_touch(cache *c, cache_item *item);
 static void cache_remove(cache *c, cache_item *item);
 static char *cache_object_copy(const char *in, int obj_size);
+static void cache_evict(cache *c);
+static void cache_insert(cache *c, const char *uri, int uri_size, const char *obj, int obj_size, time_t fetched);
 
 void cache_init(cache *c) {
     cache_item *item = (cache_item *)Malloc(sizeof(cache_item));
@@ -15,9 +17,12 @@ void cache_init(cache *c) {
     item->prev = item;
     item->next = item;
     item->size = 0;
+    item->fetched = 0;
+    item->refresh_at = 0;
 
     c->root = item;
     c->size = 0;
+    c->max_size = MAX_CACHE_SIZE;
     c->read_cnt = 0;
     Sem_init(&c->mutex, 0, 1);
     Sem_init(&c->write, 0, 1);
@@ -29,28 +34,62 @@ int cache_add(cache *c, const char *uri, int uri_size, const char *obj, int obj_
     }
     P(&c->write);
 
-    cache_item *item = (cache_item *)Malloc(sizeof(cache_item));
-    item->uri = cache_object_copy(uri, uri_size + 1);
-    item->obj = cache_object_copy(obj, obj_size);
-    item->prev = c->root;
-    item->next = c->root->next;
-    item->size = obj_size;
-    item->prev->next = item;
-    item->next->prev = item;
-
-    c->size += obj_size;
+    /* A revalidated object replaces the stale copy */
+    for (cache_item *old = c->root->next; old != c->root; old = old->next) {
+        if (!strcasecmp(old->uri, uri)) {
+            c->size -= old->size;
+            cache_remove(c, old);
+            break;
+        }
+    }
+    cache_insert(c, uri, uri_size, obj, obj_size, time(NULL));
+    V(&c->write);
+    return 0;
+}
 
-    cache_item *prev;
-    for (cache_item *item = c->root->prev; c->size > MAX_CACHE_SIZE; item = prev) {
-        c->size -= item->size;
-        prev = item->prev;
-        cache_remove(c, item);
+/*
+ * cache_restore - add an entry read back from a snapshot as the most
+ *     recently used one, keeping its original fetch time. uri must not
+ *     be cached already.
+ */
+int cache_restore(cache *c, const char *uri, int uri_size, const char *obj, int obj_size, time_t fetched) {
+    if (obj_size > MAX_OBJECT_SIZE) {
+        return -1;
     }
+    P(&c->write);
+    cache_insert(c, uri, uri_size, obj, obj_size, fetched);
     V(&c->write);
     return 0;
 }
 
-int cache_get(cache *c, const char *uri, char **obj) {
+/* cache_invalidate - drop the entry for uri, if there is one */
+void cache_invalidate(cache *c, const char *uri) {
+    P(&c->write);
+    for (cache_item *item = c->root->next; item != c->root; item = item->next) {
+        if (!strcasecmp(item->uri, uri)) {
+            c->size -= item->size;
+            cache_remove(c, item);
+            break;
+        }
+    }
+    V(&c->write);
+}
+
+/* cache_set_limit - change the capacity, evicting down to it right away */
+void cache_set_limit(cache *c, int max_size) {
+    P(&c->write);
+    c->max_size = max_size;
+    cache_evict(c);
+    V(&c->write);
+}
+
+/*
+ * cache_get - look up uri and, on a hit, hold the read lock until
+ *     cache_read_done. *state tells the caller how the object may be
+ *     used; exactly one caller per CACHE_REVALIDATE_RETRY period is told
+ *     to revalidate a stale entry.
+ */
+int cache_get(cache *c, const char *uri, char **obj, int *state) {
     if (!uri) return -1;
 
     P(&c->mutex);
@@ -62,6 +101,23 @@ int cache_get(cache *c, const char *uri, char **obj) {
 
     for (cache_item *item = c->root->next; item != c->root; item = item->next) {
         if (!strcasecmp(item->uri, uri)) {
+            time_t now = time(NULL);
+            int age = now - item->fetched;
+            if (age > CACHE_MAX_STALE_IF_ERROR) break;
+
+            if (age <= CACHE_MAX_FRESH) {
+                *state = CACHE_FRESH;
+            } else if (age <= CACHE_MAX_STALE) {
+                *state = CACHE_STALE;
+                P(&c->mutex);
+                if (now - item->refresh_at >= CACHE_REVALIDATE_RETRY) {
+                    item->refresh_at = now;
+                    *state = CACHE_REVALIDATE;
+                }
+                V(&c->mutex);
+            } else {
+                *state = CACHE_EXPIRED;
+            }
             cache_touch(c, item);
             *obj = item->obj;
             return item->size;
@@ -108,4 +164,32 @@ static char *cache_object_copy(const char *in, int obj_size) {
     char *out = (char *)Malloc(obj_size * sizeof(char));
     memcpy(out, in, obj_size * sizeof(char));
     return out;
-}
\ No newline at end of file
+}
+
+/* Drop least recently used items until the cache fits; caller holds c->write */
+static void cache_evict(cache *c) {
+    cache_item *prev;
+    for (cache_item *item = c->root->prev; c->size > c->max_size; item = prev) {
+        c->size -= item->size;
+        prev = item->prev;
+        cache_remove(c, item);
+    }
+}
+
+/* Link a copy of uri/obj in at the front of the LRU list; caller holds c->write */
+static void cache_insert(cache *c, const char *uri, int uri_size, const char *obj, int obj_size, time_t fetched) {
+    cache_item *item = (cache_item *)Malloc(sizeof(cache_item));
+    item->uri = cache_object_copy(uri, uri_size + 1);
+    item->uri[uri_size] = '\0';
+    item->obj = cache_object_copy(obj, obj_size);
+    item->prev = c->root;
+    item->next = c->root->next;
+    item->size = obj_size;
+    item->fetched = fetched;
+    item->refresh_at = 0;
+    item->prev->next = item;
+    item->next->prev = item;
+
+    c->size += obj_size;
+    cache_evict(c);
+}
@@ -1,20 +1,38 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Ages (seconds since fetch) that bound how an entry may be served */
+#define CACHE_MAX_FRESH 60             /* Served as-is */
+#define CACHE_MAX_STALE 600            /* Served while one request revalidates it */
+#define CACHE_MAX_STALE_IF_ERROR 86400 /* Served only when the origin fails */
+#define CACHE_REVALIDATE_RETRY 5       /* Seconds before a lost refresh may be retried */
+
+/* cache_get freshness states */
+#define CACHE_FRESH 0
+#define CACHE_STALE 1      /* Stale; another request is revalidating it */
+#define CACHE_REVALIDATE 2 /* Stale; the caller should revalidate it */
+#define CACHE_EXPIRED 3    /* Only usable if the origin cannot be reached */
+
 typedef struct cache_item {
     char *uri;
     char *obj;
     struct cache_item *prev;
     struct cache_item *next;
     int size;
+    time_t fetched;    /* When the object was stored */
+    time_t refresh_at; /* When a revalidation was last started */
 } cache_item;
 
 typedef struct {
     cache_item *root;
     int size;
+    int max_size; /* Eviction starts above this many bytes of objects */
     int read_cnt;
     sem_t mutex;
     sem_t write;
@@ -22,6 +40,10 @@ typedef struct {
 
 void cache_init(cache *c);
 int cache_add(cache *c, const char *uri, int uri_size, const char *obj, int obj_size);
-int cache_get(cache *c, const char *uri, char **obj);
+int cache_restore(cache *c, const char *uri, int uri_size, const char *obj, int obj_size, time_t fetched);
+int cache_get(cache *c, const char *uri, char **obj, int *state);
 void cache_read_done(cache *c);
+void cache_set_limit(cache *c, int max_size);
+void cache_invalidate(cache *c, const char *uri);
 
+#endif /* __CACHE_H__ */
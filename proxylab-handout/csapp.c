@@ -1,6 +1,14 @@
 /*
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated 10/2026:
+ *   - rio_readlineb: scan and copy whole buffered spans instead of
+ *     reading one byte at a time
+ *   - Added rio_peekline and rio_consumeb for zero-copy line access
+ *   - Added rio_writev for gathering a response into one system call
+ *   - rio_t buffers are heap or per-thread pool backed with a size set
+ *     by rio_readinitb_size; large reads bypass the internal buffer
+ *
  * Updated 10/2016 reb:
  *   - Fixed bug in sio_ltoa that didn't cover negative numbers
  *
@@ -642,6 +650,60 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write all iovcnt buffers of iov (unbuffered)
+ *
+ *    Lets callers assemble a response from several fragments and send
+ *    it with one writev() in the common case. iov is updated in place
+ *    as a short write advances through it.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) {
+    size_t n = 0, nleft;
+    ssize_t nwritten;
+
+    for (int i = 0; i < iovcnt; i++) n += iov[i].iov_len;
+    nleft = n;
+    while (nleft > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                nwritten = 0;   /* and call writev() again */
+            else
+                return -1; /* errno set by writev() */
+        }
+        nleft -= nwritten;
+
+        /* Skip the buffers that went out and trim a partial one */
+        while (iovcnt > 0 && nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (nwritten > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return n;
+}
+
+/*
+ * rio_fill - refill the internal buffer if it is empty. Returns the
+ *    number of unread bytes, 0 on EOF, or -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp) {
+    while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR) /* Interrupted by sig handler return */
+                return -1;
+        } else if (rp->rio_cnt == 0) /* EOF */
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -653,18 +715,15 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     int cnt;
+    ssize_t rc;
 
-    while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
-            if (errno != EINTR) /* Interrupted by sig handler return */
-                return -1;
-        } else if (rp->rio_cnt == 0) /* EOF */
-            return 0;
-        else
-            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    /* Huge reads bypass the internal buffer and land in usrbuf directly */
+    while (rp->rio_cnt <= 0 && n >= rp->rio_bufsize) {
+        if ((rc = read(rp->rio_fd, usrbuf, n)) >= 0 || errno != EINTR) return rc;
     }
 
+    if ((rc = rio_fill(rp)) <= 0) return rc;
+
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
     if (rp->rio_cnt < n) cnt = rp->rio_cnt;
@@ -675,16 +734,86 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
 }
 /* $end rio_read */
 
+/*
+ * Per-thread pool of Rio buffers, so that a worker serving request after
+ * request does not malloc and free a buffer for each one. A buffer is
+ * only handed out again for a stream of its own size. The pool is freed
+ * when its thread exits.
+ */
+typedef struct {
+    int cnt;
+    char *bufs[RIO_POOL_MAX];
+    size_t sizes[RIO_POOL_MAX];
+} rio_pool_t;
+
+static pthread_key_t rio_pool_key;
+static pthread_once_t rio_pool_once = PTHREAD_ONCE_INIT;
+
+static void rio_pool_free(void *vargp) {
+    rio_pool_t *pool = vargp;
+
+    for (int i = 0; i < pool->cnt; i++) free(pool->bufs[i]);
+    free(pool);
+}
+
+static void rio_pool_init(void) { pthread_key_create(&rio_pool_key, rio_pool_free); }
+
+static rio_pool_t *rio_pool(void) {
+    rio_pool_t *pool;
+
+    pthread_once(&rio_pool_once, rio_pool_init);
+    if (!(pool = pthread_getspecific(rio_pool_key))) {
+        pool = Calloc(1, sizeof(rio_pool_t));
+        pthread_setspecific(rio_pool_key, pool);
+    }
+    return pool;
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 /* $begin rio_readinitb */
-void rio_readinitb(rio_t *rp, int fd) {
+void rio_readinitb(rio_t *rp, int fd) { rio_readinitb_size(rp, fd, RIO_BUFSIZE); }
+/* $end rio_readinitb */
+
+/*
+ * rio_readinitb_size - Like rio_readinitb, with a bufsize-byte internal
+ *     buffer. Every rio_t must be released with rio_readfreeb.
+ */
+void rio_readinitb_size(rio_t *rp, int fd, size_t bufsize) {
+    rio_pool_t *pool = rio_pool();
+    int i;
+
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
+    rp->rio_bufsize = bufsize;
+    for (i = pool->cnt - 1; i >= 0 && pool->sizes[i] != bufsize; i--)
+        ;
+    if (i >= 0) {
+        rp->rio_buf = pool->bufs[i];
+        pool->cnt--;
+        pool->bufs[i] = pool->bufs[pool->cnt];
+        pool->sizes[i] = pool->sizes[pool->cnt];
+    } else
+        rp->rio_buf = Malloc(bufsize);
     rp->rio_bufptr = rp->rio_buf;
 }
-/* $end rio_readinitb */
+
+/*
+ * rio_readfreeb - Release the internal buffer of rp
+ */
+void rio_readfreeb(rio_t *rp) {
+    rio_pool_t *pool;
+
+    if (!rp->rio_buf) return;
+    if ((pool = rio_pool())->cnt < RIO_POOL_MAX) {
+        pool->bufs[pool->cnt] = rp->rio_buf;
+        pool->sizes[pool->cnt++] = rp->rio_bufsize;
+    } else
+        Free(rp->rio_buf);
+    rp->rio_buf = rp->rio_bufptr = NULL;
+    rp->rio_cnt = 0;
+}
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
@@ -707,34 +836,86 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes, at most one read() (buffered)
+ *
+ *    Returns whatever is buffered, or else what one read() delivers, so
+ *    callers can relay a stream as it arrives. Requests of rio_bufsize
+ *    bytes or more are read straight into usrbuf.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) { return rio_read(rp, usrbuf, n); }
+
 /*
  * rio_readlineb - Robustly read a text line (buffered)
+ *
+ *    Scans each buffered span for the newline with memchr (vectorized
+ *    in libc) and copies the whole span at once, rather than pulling
+ *    one byte at a time through rio_read.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break; /* EOF, some data was read */
-        } else
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (!nl && n + 1 < maxlen) {
+        if ((rc = rio_fill(rp)) < 0)
             return -1; /* Error */
+        else if (rc == 0)
+            break; /* EOF, maybe with some data read */
+
+        cnt = maxlen - 1 - n;
+        if (rp->rio_cnt < cnt) cnt = rp->rio_cnt;
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt))) cnt = nl - rp->rio_bufptr + 1;
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufp += cnt;
+        n += cnt;
     }
-    *bufp = 0;
-    return n - 1;
+    if (maxlen > 0) *bufp = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_peekline - Make the next text line available without copying it
+ *
+ *    Sets *linep to the next unread line inside the internal buffer and
+ *    returns its length, newline included. The line stays unread until
+ *    rio_consumeb, and *linep is valid until the next call on rp. A line
+ *    longer than the buffer, or the tail before EOF, is returned without
+ *    its newline. Returns 0 on EOF and -1 on error.
+ */
+ssize_t rio_peekline(rio_t *rp, char **linep) {
+    ssize_t rc;
+    char *nl;
+
+    if ((rc = rio_fill(rp)) <= 0) return rc;
+    while (!(nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) && rp->rio_cnt < rp->rio_bufsize) {
+        /* Slide the partial line to the front and read more behind it */
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+        if ((rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, rp->rio_bufsize - rp->rio_cnt)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        } else if (rc == 0)
+            break; /* EOF, return the partial line */
+        rp->rio_cnt += rc;
+    }
+    *linep = rp->rio_bufptr;
+    return nl ? nl - rp->rio_bufptr + 1 : rp->rio_cnt;
+}
+
+/*
+ * rio_consumeb - Mark n buffered bytes (at most rio_cnt) as read
+ */
+void rio_consumeb(rio_t *rp, size_t n) {
+    if (n > rp->rio_cnt) n = rp->rio_cnt;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -749,6 +930,10 @@ void Rio_writen(int fd, void *usrbuf, size_t n) {
     if (rio_writen(fd, usrbuf, n) != n) unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt) {
+    if (rio_writev(fd, iov, iovcnt) < 0) unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd) { rio_readinitb(rp, fd); }
 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -42,12 +43,14 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 8192 /* Default internal buffer size */
+#define RIO_POOL_MAX 4   /* Buffers each thread keeps for reuse */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer (heap or thread pool) */
+    size_t rio_bufsize;        /* Size of rio_buf */
 } rio_t;
 /* $end rio_t */
 
@@ -175,13 +178,21 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+/* Match every rio_readinitb with a rio_readfreeb before the rio_t is reinitialized or dropped */
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitb_size(rio_t *rp, int fd, size_t bufsize);
+void rio_readfreeb(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_peekline(rio_t *rp, char **linep);
+void	rio_consumeb(rio_t *rp, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -0,0 +1,98 @@
+#include "handoff.h"
+
+#include <sys/un.h>
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr);
+
+/*
+ * handoff_take - ask the proxy serving the control socket at path for
+ *     its listening socket. Returns the descriptor, or -1 if no proxy
+ *     answers there.
+ */
+int handoff_take(const char *path) {
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte, control[CMSG_SPACE(sizeof(int))];
+    int fd, listenfd = -1;
+
+    if (handoff_addr(path, &addr) < 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, 0) == 1 && (cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&listenfd, CMSG_DATA(cmsg), sizeof(int));
+    close(fd);
+    return listenfd;
+}
+
+/*
+ * handoff_listen - bind the control socket at path, taking the name over
+ *     from any previous proxy, and return it listening
+ */
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (handoff_addr(path, &addr) < 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    unlink(path);
+    if (bind(fd, (SA *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* handoff_wait - wait for a successor to connect to ctlfd */
+int handoff_wait(int ctlfd) { return accept(ctlfd, NULL, NULL); }
+
+/*
+ * handoff_give - send listenfd to the successor connected on fd, which
+ *     is closed. Returns 0 once the descriptor is on its way.
+ */
+int handoff_give(int fd, int listenfd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 'L', control[CMSG_SPACE(sizeof(int))];
+    int rc;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listenfd, sizeof(int));
+    rc = sendmsg(fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
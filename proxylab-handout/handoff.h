@@ -0,0 +1,16 @@
+/*
+ * handoff.h - pass the listening socket from a running proxy to its
+ *     replacement over a Unix domain control socket, so a restart never
+ *     refuses a connection
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "csapp.h"
+
+int handoff_take(const char *path);
+int handoff_listen(const char *path);
+int handoff_wait(int ctlfd);
+int handoff_give(int fd, int listenfd);
+
+#endif /* __HANDOFF_H__ */
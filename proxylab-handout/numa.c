@@ -0,0 +1,86 @@
+#include "numa.h"
+
+#include <sys/syscall.h>
+
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+static int numa_read_cpulist(numa_topology *t, const char *path, int node);
+static int numa_setaffinity(unsigned long *mask);
+
+/*
+ * numa_init - discover which CPUs belong to which node. Without a
+ *     readable /sys/devices/system/node every online CPU lands in node 0.
+ */
+void numa_init(numa_topology *t) {
+    char path[MAXLINE];
+    int id, n;
+
+    memset(t, 0, sizeof(*t));
+    for (id = 0; id < NUMA_MAX_NODES && t->nnodes < NUMA_MAX_NODES; id++) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", id);
+        t->first[t->nnodes] = t->ncpus;
+        if ((n = numa_read_cpulist(t, path, t->nnodes)) > 0) t->nnodes++;
+    }
+    if (t->nnodes == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (id = 0; id < n && id < NUMA_MAX_CPUS; id++) t->cpus[t->ncpus++] = id;
+        t->nnodes = 1;
+    }
+    t->first[t->nnodes] = t->ncpus;
+}
+
+/* numa_node_of - node of cpu, or 0 for a CPU the topology does not know */
+int numa_node_of(numa_topology *t, int cpu) { return cpu >= 0 && cpu < NUMA_MAX_CPUS ? t->node_of[cpu] : 0; }
+
+/* numa_pin_cpu - restrict the calling thread to cpu */
+int numa_pin_cpu(int cpu) {
+    unsigned long mask[NUMA_MAX_CPUS / MASK_BITS] = {0};
+
+    mask[cpu / MASK_BITS] |= 1UL << (cpu % MASK_BITS);
+    return numa_setaffinity(mask);
+}
+
+/* numa_pin_node - restrict the calling thread to the CPUs of node */
+int numa_pin_node(numa_topology *t, int node) {
+    unsigned long mask[NUMA_MAX_CPUS / MASK_BITS] = {0};
+
+    for (int i = t->first[node]; i < t->first[node + 1]; i++)
+        mask[t->cpus[i] / MASK_BITS] |= 1UL << (t->cpus[i] % MASK_BITS);
+    return numa_setaffinity(mask);
+}
+
+/* numa_unpin - let the calling thread run on any known CPU again */
+int numa_unpin(numa_topology *t) {
+    unsigned long mask[NUMA_MAX_CPUS / MASK_BITS] = {0};
+
+    for (int i = 0; i < t->ncpus; i++) mask[t->cpus[i] / MASK_BITS] |= 1UL << (t->cpus[i] % MASK_BITS);
+    return numa_setaffinity(mask);
+}
+
+/* Append the CPUs in a sysfs list such as "0-3,8-11" to node; returns how many */
+static int numa_read_cpulist(numa_topology *t, const char *path, int node) {
+    FILE *fp;
+    char buf[MAXLINE], *p, *end;
+    long lo, hi;
+    int n = 0;
+
+    if (!(fp = fopen(path, "r"))) return -1;
+    if (!fgets(buf, sizeof(buf), fp)) buf[0] = '\0';
+    fclose(fp);
+
+    for (p = buf; *p && *p != '\n'; p = *end == ',' ? end + 1 : end) {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p) break;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi && lo < NUMA_MAX_CPUS && t->ncpus < NUMA_MAX_CPUS; lo++, n++) {
+            t->cpus[t->ncpus++] = lo;
+            t->node_of[lo] = node;
+        }
+    }
+    return n;
+}
+
+static int numa_setaffinity(unsigned long *mask) {
+    /* The raw call keeps this file free of _GNU_SOURCE, which csapp.h cannot coexist with */
+    return syscall(SYS_sched_setaffinity, 0, NUMA_MAX_CPUS / 8, mask) < 0 ? -1 : 0;
+}
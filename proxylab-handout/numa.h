@@ -0,0 +1,27 @@
+/*
+ * numa.h - CPU and memory node topology read from sysfs, for pinning
+ *     threads and keeping the data they touch on their own node
+ */
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include "csapp.h"
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+typedef struct {
+    int nnodes;                    /* Nodes with CPUs, numbered densely from 0 */
+    int ncpus;
+    int cpus[NUMA_MAX_CPUS];       /* CPU ids, grouped by node */
+    int first[NUMA_MAX_NODES + 1]; /* Node n owns cpus[first[n]] up to cpus[first[n + 1]] */
+    int node_of[NUMA_MAX_CPUS];    /* Indexed by CPU id */
+} numa_topology;
+
+void numa_init(numa_topology *t);
+int numa_node_of(numa_topology *t, int cpu);
+int numa_pin_cpu(int cpu);
+int numa_pin_node(numa_topology *t, int node);
+int numa_unpin(numa_topology *t);
+
+#endif /* __NUMA_H__ */
@@ -0,0 +1,189 @@
+#include "origin.h"
+
+#include <poll.h>
+
+static origin *origin_lookup(origin_table *t, const char *hostname, int port);
+static void origin_sweep(origin_table *t);
+static unsigned origin_hash(const char *hostname, int port);
+
+void origin_table_init(origin_table *t, int max_inflight) {
+    memset(t->buckets, 0, sizeof(t->buckets));
+    t->count = 0;
+    t->max_inflight = max_inflight;
+    Sem_init(&t->mutex, 0, 1);
+}
+
+/* origin_table_set_limit - change the in-flight cap; busy origins drain down to it */
+void origin_table_set_limit(origin_table *t, int max_inflight) {
+    P(&t->mutex);
+    t->max_inflight = max_inflight;
+    V(&t->mutex);
+}
+
+/*
+ * origin_acquire - reserve an in-flight slot on <hostname, port>. Fails
+ *     fast with ORIGIN_OPEN while the breaker is open and ORIGIN_BUSY when
+ *     the origin already has max_inflight requests outstanding. Once the
+ *     cooldown expires a single trial request is let through (half-open);
+ *     its outcome decides whether the breaker closes again. *probep says
+ *     whether this is that request, for origin_release.
+ */
+int origin_acquire(origin_table *t, const char *hostname, int port, origin **op, int *probep) {
+    int rc = ORIGIN_OK;
+
+    *probep = 0;
+    P(&t->mutex);
+    origin *o = origin_lookup(t, hostname, port);
+    if (!o)
+        rc = ORIGIN_BUSY;
+    else if (o->failures >= ORIGIN_FAIL_THRESHOLD && (time(NULL) < o->open_until || o->probing))
+        rc = ORIGIN_OPEN;
+    else if (o->inflight >= t->max_inflight)
+        rc = ORIGIN_BUSY;
+    else {
+        if (o->failures >= ORIGIN_FAIL_THRESHOLD) o->probing = *probep = 1;
+        o->inflight++;
+    }
+    V(&t->mutex);
+
+    *op = o;
+    return rc;
+}
+
+/*
+ * origin_release - give back the slot taken by origin_acquire and record
+ *     whether the origin answered properly. Only the trial request ends
+ *     the half-open state; others that were already in flight when the
+ *     breaker opened leave it alone. ok == ORIGIN_NO_VERDICT gives the
+ *     slot back without counting the request either way.
+ */
+void origin_release(origin_table *t, origin *o, int probe, int ok) {
+    P(&t->mutex);
+    o->inflight--;
+    if (probe) o->probing = 0;
+    if (ok > 0) {
+        o->failures = 0;
+    } else if (ok == 0 && ++o->failures >= ORIGIN_FAIL_THRESHOLD) {
+        o->open_until = time(NULL) + ORIGIN_COOLDOWN;
+    }
+    V(&t->mutex);
+}
+
+/*
+ * origin_connect - like open_clientfd, but gives up on each address after
+ *     ORIGIN_CONNECT_TIMEOUT and arms the returned socket with
+ *     ORIGIN_IO_TIMEOUT so that a stalled origin makes reads and writes
+ *     fail with EAGAIN instead of blocking the worker forever.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int origin_connect(const char *hostname, int port) {
+    int clientfd = -1, rc, flags, err;
+    char portstr[16];
+    socklen_t errlen;
+    struct addrinfo hints, *listp, *p;
+    struct pollfd pfd;
+    struct timeval tv;
+
+    sprintf(portstr, "%d", port);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(hostname, portstr, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, portstr, gai_strerror(rc));
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+
+        /* Connect without blocking, then wait for it with a deadline */
+        flags = fcntl(clientfd, F_GETFL, 0);
+        fcntl(clientfd, F_SETFL, flags | O_NONBLOCK);
+        err = 0;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) < 0) {
+            err = errno;
+            if (err == EINPROGRESS) {
+                pfd.fd = clientfd;
+                pfd.events = POLLOUT;
+                while ((rc = poll(&pfd, 1, ORIGIN_CONNECT_TIMEOUT)) < 0 && errno == EINTR)
+                    ;
+                errlen = sizeof(err);
+                if (rc == 0)
+                    err = ETIMEDOUT;
+                else if (rc < 0 || getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+                    err = errno;
+            }
+        }
+        if (!err) {
+            fcntl(clientfd, F_SETFL, flags);
+            break; /* Success */
+        }
+        close(clientfd);
+        errno = err;
+    }
+
+    freeaddrinfo(listp);
+    if (!p) /* All connects failed */
+        return -1;
+
+    tv.tv_sec = ORIGIN_IO_TIMEOUT / 1000;
+    tv.tv_usec = (ORIGIN_IO_TIMEOUT % 1000) * 1000;
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return clientfd;
+}
+
+/*
+ * Find or create the entry for <hostname, port>, or NULL if the table is
+ * full of origins that are busy or have an open breaker; caller holds
+ * t->mutex
+ */
+static origin *origin_lookup(origin_table *t, const char *hostname, int port) {
+    unsigned idx = origin_hash(hostname, port) % ORIGIN_BUCKETS;
+
+    for (origin *o = t->buckets[idx]; o; o = o->next) {
+        if (o->port == port && !strcasecmp(o->hostname, hostname)) return o;
+    }
+
+    if (t->count >= ORIGIN_MAX_ENTRIES) origin_sweep(t);
+    if (t->count >= ORIGIN_MAX_ENTRIES) return NULL;
+    t->count++;
+    origin *o = (origin *)Calloc(1, sizeof(origin));
+    o->hostname = (char *)Malloc(strlen(hostname) + 1);
+    strcpy(o->hostname, hostname);
+    o->port = port;
+    o->next = t->buckets[idx];
+    t->buckets[idx] = o;
+    return o;
+}
+
+/*
+ * Forget every origin that nobody holds and whose breaker is not open;
+ * all they remember is a failure count that has not tripped, or one that
+ * has cooled down. Caller holds t->mutex.
+ */
+static void origin_sweep(origin_table *t) {
+    time_t now = time(NULL);
+    origin **pp, *o;
+
+    for (int i = 0; i < ORIGIN_BUCKETS; i++) {
+        for (pp = &t->buckets[i]; (o = *pp);) {
+            if (o->inflight == 0 && (o->failures < ORIGIN_FAIL_THRESHOLD || now >= o->open_until)) {
+                *pp = o->next;
+                Free(o->hostname);
+                Free(o);
+                t->count--;
+            } else {
+                pp = &o->next;
+            }
+        }
+    }
+}
+
+static unsigned origin_hash(const char *hostname, int port) {
+    unsigned h = 5381;
+    for (const char *s = hostname; *s; s++) h = h * 33 + tolower((unsigned char)*s);
+    return h * 33 + port;
+}
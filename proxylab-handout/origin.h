@@ -0,0 +1,46 @@
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+
+/* Per-origin limits */
+#define ORIGIN_MAX_INFLIGHT 4       /* Concurrent upstream requests per origin */
+#define ORIGIN_CONNECT_TIMEOUT 3000 /* Milliseconds to establish a connection */
+#define ORIGIN_IO_TIMEOUT 5000      /* Milliseconds a single read/write may block */
+#define ORIGIN_FAIL_THRESHOLD 5     /* Consecutive failures that open the breaker */
+#define ORIGIN_COOLDOWN 10          /* Seconds the breaker stays open */
+#define ORIGIN_BUCKETS 64
+#define ORIGIN_MAX_ENTRIES 1024     /* Origins tracked before idle ones are forgotten */
+
+/* origin_acquire return codes */
+#define ORIGIN_OK 0
+#define ORIGIN_BUSY -1 /* In-flight cap reached, or too many origins to track */
+#define ORIGIN_OPEN -2 /* Circuit breaker is open */
+
+/* origin_release ok value for requests that never really reached the origin */
+#define ORIGIN_NO_VERDICT -1
+
+typedef struct origin {
+    char *hostname;
+    int port;
+    int inflight;      /* Requests currently talking to this origin */
+    int failures;      /* Consecutive failed requests */
+    int probing;       /* A half-open trial request is in flight */
+    time_t open_until; /* Breaker rejects requests until this time */
+    struct origin *next;
+} origin;
+
+typedef struct {
+    origin *buckets[ORIGIN_BUCKETS];
+    int count; /* Entries in the buckets */
+    int max_inflight;
+    sem_t mutex;
+} origin_table;
+
+void origin_table_init(origin_table *t, int max_inflight);
+void origin_table_set_limit(origin_table *t, int max_inflight);
+int origin_acquire(origin_table *t, const char *hostname, int port, origin **op, int *probep);
+void origin_release(origin_table *t, origin *o, int probe, int ok);
+int origin_connect(const char *hostname, int port);
+
+#endif /* __ORIGIN_H__ */
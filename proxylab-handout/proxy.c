@@ -1,14 +1,35 @@
 #include <stdio.h>
 
+#include <limits.h>
+#include <poll.h>
+
+#include "arena.h"
 #include "cache.h"
 #include "csapp.h"
+#include "handoff.h"
+#include "numa.h"
+#include "origin.h"
+#include "snapshot.h"
+#include "tunnel.h"
+#include "uring.h"
 
 #define CONCURRENCY 8
+#define KEEPALIVE_TIMEOUT 5000 /* Milliseconds a client may take to send its next request */
+#define MAX_WORKERS 256
+#define DRAIN_TIMEOUT 30      /* Seconds accepted connections get to finish on shutdown */
+#define WORKER_EXIT -1        /* sbuf item that retires the worker removing it */
+#define ACCEPT_BACKOFF 100    /* Milliseconds to wait before accepting again when out of descriptors */
+#define TUNNEL_SHARE 2        /* Tunnels may tie up at most 1/TUNNEL_SHARE of the workers */
+#define ORIGIN_RIO_SIZE 32768 /* Origin read buffer: fewer reads for headers and chunk framing */
+#define MAX_REFRESHES 16      /* Revalidations in flight; past it stale hits wait for a later retry */
 
 #define HEADER_HOST "Host:"
 #define HEADER_USER_AGENT "User-Agent:"
 #define HEADER_CONNECTION "Connection:"
 #define HEADER_PROXY_CONNECTION "Proxy-Connection:"
+#define HEADER_KEEP_ALIVE "Keep-Alive:"
+#define HEADER_CONTENT_LENGTH "Content-Length:"
+#define HEADER_TRANSFER_ENCODING "Transfer-Encoding:"
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
@@ -30,9 +51,90 @@ typedef struct {
     sem_t items; /* Counts available items */
 } sbuf_t;
 
+typedef struct {
+    http_uri uri;
+    char *header; /* Request to replay against the origin */
+    char *path;   /* Cache key */
+    int node;     /* Shard to store the result in */
+} refresh_args;
+
+/* Settings read from the -f file at startup and again on SIGHUP */
+typedef struct {
+    int cache_size;   /* Bytes of objects the cache may hold */
+    int workers;      /* Worker threads serving clients */
+    int max_inflight; /* Concurrent requests per origin */
+} proxy_config;
+
+/* An origin connection left open after a complete response */
+typedef struct {
+    int fd; /* -1 if there is none */
+    char hostname[MAXLINE];
+    int port;
+} upstream_t;
+
+/* Per-worker state, reused across connections */
+typedef struct {
+    rio_t rio;     /* Client connection */
+    arena arena;   /* Strings and buffers of the current request */
+    int node;      /* Cache shard and accept queue to prefer */
+    upstream_t up; /* Idle origin connection from the last fetch */
+    char *obj_buf; /* MAX_OBJECT_SIZE bytes holding the response being relayed */
+    uring ring;    /* Upstream I/O when use_ring is set */
+    int use_ring;
+} worker_t;
+
+/* user_data tags for io_uring completions */
+#define URING_ACCEPT 1
+#define URING_CONNECT 2
+#define URING_SEND 3
+#define URING_READ 4
+#define URING_TIMEOUT 5
+#define URING_WAKE 6
+#define URING_CANCEL 7
+#define URING_TAGS 8
+
+/* fetch return codes */
+#define FETCH_OK 0
+#define FETCH_BUSY -1    /* Origin is over its in-flight cap or its breaker is open */
+#define FETCH_CONNECT -2 /* Could not connect to the origin */
+#define FETCH_ORIGIN -3  /* Origin failed before anything was relayed */
+#define FETCH_CLIENT -4  /* Client went away, or the response broke off mid-relay */
+
 void *thread(void *vargp);
-void doit(int fd);
-int read_requesthdrs(rio_t *rio, char *header, http_uri *uri);
+void accept_loop(int listenfd);
+int accept_uring(int listenfd);
+void enqueue(int connfd);
+int live_node(int node);
+int worker_cpu(int id);
+int worker_node(int id);
+int shard_get(int node, const char *key, char **obj, int *state, cache **cp);
+void shard_add(int node, const char *key, char *obj, int size);
+void shard_set_limit(int cache_size);
+void stop_accepting(void);
+void drain(void);
+void save_snapshot(void);
+void set_workers(int n);
+int load_config(const char *path, proxy_config *cfg);
+void *signal_thread(void *vargp);
+void *control_thread(void *vargp);
+int doit(worker_t *w, int fd);
+int fetch(upstream_t *up, http_uri *uri, char *header, int fd, int *keepp, char *obj_buf, int *sizep);
+int relay_body(rio_t *rp, int fd, char *obj_buf, int *sizep, long len);
+int relay_chunked(rio_t *rp, int fd, char *obj_buf, int *sizep);
+void upstream_close(upstream_t *up);
+int serve_cached(int fd, char *obj, int size, int keep);
+int strip_hop_headers(char *obj, int size);
+int header_is(const char *line, const char *name);
+int header_has(const char *line, size_t n, const char *token);
+int fetch_uring(worker_t *w, http_uri *uri, char *header, int fd, int *sizep);
+void ring_down(worker_t *w);
+int reap_chain(uring *r, int n, int *res);
+void connect_tunnel(int fd, rio_t *rio, char *target);
+int tunnel_admit(void);
+void tunnel_done(void);
+void refresh(http_uri *uri, char *header, char *path, int node);
+void *refresh_thread(void *vargp);
+int read_requesthdrs(rio_t *rio, char *header, http_uri *uri, int *keepp);
 int parse_uri(char *path, http_uri *uri);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 
@@ -40,150 +142,1132 @@ void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
+int sbuf_tryremove(sbuf_t *sp, int *itemp);
 
-static cache c;
+static cache *shards[NUMA_MAX_NODES]; /* One per node with -p, otherwise just one */
+static int nshards = 1;
+static sbuf_t queues[NUMA_MAX_NODES]; /* Accept queues, one per shard */
+static int node_workers[NUMA_MAX_NODES]; /* Under workers_mutex */
+static sem_t workers_mutex;              /* Held while routing a connection or changing workers */
+static numa_topology topo;
+static origin_table origins;
+static int use_uring;         /* -u: drive sockets through io_uring */
+static int pin;               /* -p: pin workers, and shard by node */
+static char *config_path;     /* -f: reloaded on SIGHUP */
+static char *snapshot_path;   /* -c: cache saved on exit and SIGUSR1, loaded at startup */
+static int handed_off;        /* The successor loaded our snapshot already */
+static proxy_config config;
+static int listenfd;
+static int nworkers;          /* Changed by main at startup, then only by the signal thread */
+static int wakefd[2];         /* Readable once the accept loop should stop */
+static volatile int draining; /* Finish accepted connections, take no new ones */
+static int active;            /* Connections accepted but not yet closed */
+static int tunnels;           /* CONNECT tunnels open; under active_mutex too */
+static int refreshes;         /* Refresh threads running; under active_mutex too */
+static sem_t active_mutex;
+static sem_t snapshot_mutex;  /* One save_snapshot at a time; they share a temp file */
 
 int main(int argc, char **argv) {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    sbuf_t sbuf;
+    char *ctl_path = NULL;
+    int opt, ctlfd, n;
     pthread_t tid;
+    sigset_t mask;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    config.cache_size = MAX_CACHE_SIZE;
+    config.workers = CONCURRENCY;
+    config.max_inflight = ORIGIN_MAX_INFLIGHT;
+    while ((opt = getopt(argc, argv, "upc:f:s:")) != -1) {
+        if (opt == 'u')
+            use_uring = 1;
+        else if (opt == 'p')
+            pin = 1;
+        else if (opt == 'c')
+            snapshot_path = optarg;
+        else if (opt == 'f')
+            config_path = optarg;
+        else if (opt == 's')
+            ctl_path = optarg;
+        else
+            break;
+    }
+    if (opt != -1 || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-u] [-p] [-c snapshot] [-f config] [-s control-socket] <port>\n", argv[0]);
         exit(1);
     }
+    if (config_path && load_config(config_path, &config) < 0) exit(1);
+
+    /* Signals are taken by the signal thread alone; a vanished client must not kill us */
+    Signal(SIGPIPE, SIG_IGN);
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGUSR1);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    Sem_init(&active_mutex, 0, 1);
+    Sem_init(&snapshot_mutex, 0, 1);
+    Sem_init(&workers_mutex, 0, 1);
+    if (pipe(wakefd) < 0) unix_error("pipe error");
+    numa_init(&topo);
+    nshards = pin ? topo.nnodes : 1;
+    for (int i = 0; i < nshards; i++) {
+        /* Touched first from its own node, each shard's page is allocated there */
+        if (pin) numa_pin_node(&topo, i);
+        shards[i] = Mmap(NULL, sizeof(cache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        cache_init(shards[i]);
+        sbuf_init(&queues[i], MAXBUF);
+    }
+    if (pin) numa_unpin(&topo);
+    shard_set_limit(config.cache_size);
+    origin_table_init(&origins, config.max_inflight);
+
+    /* Take the listening socket over from the proxy we replace, if one answers */
+    if (ctl_path && (listenfd = handoff_take(ctl_path)) >= 0)
+        printf("Took over the listening socket from %s\n", ctl_path);
+    else
+        listenfd = Open_listenfd(argv[optind]);
+    /* Another process may accept from the same socket, so a wakeup can find it empty */
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+    /* A predecessor saves its cache before handing over, so this picks up its latest contents */
+    if (snapshot_path && (n = snapshot_load(snapshot_path, shards, nshards)) >= 0)
+        printf("Restored %d cached objects from %s\n", n, snapshot_path);
+    else if (snapshot_path && n == SNAPSHOT_SHARDS)
+        fprintf(stderr, "ignoring %s: saved with a different number of cache shards than the %d here (-p)\n",
+                snapshot_path, nshards);
+    else if (snapshot_path && errno != ENOENT)
+        fprintf(stderr, "ignoring %s: %s\n", snapshot_path, strerror(errno));
+
+    set_workers(config.workers);
+    Pthread_create(&tid, NULL, signal_thread, NULL);
+    if (ctl_path) {
+        if ((ctlfd = handoff_listen(ctl_path)) < 0) unix_error("control socket error");
+        Pthread_create(&tid, NULL, control_thread, (void *)(long)ctlfd);
+    }
 
-    sbuf_init(&sbuf, MAXBUF);
-    cache_init(&c);
-    listenfd = Open_listenfd(argv[1]);
+    if (!use_uring || accept_uring(listenfd) < 0) accept_loop(listenfd);
+    drain();
+    exit(0);
+}
 
-    for (int i = 0; i < CONCURRENCY; i++) Pthread_create(&tid, NULL, thread, &sbuf);
+/* accept_loop - queue clients for the workers until stop_accepting */
+void accept_loop(int listenfd) {
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct pollfd pfds[2] = {{listenfd, POLLIN, 0}, {wakefd[0], POLLIN, 0}};
 
     while (1) {
+        if (poll(pfds, 2, -1) < 0) continue;
+        if (pfds[1].revents) return;
         clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        sbuf_insert(&sbuf, connfd);
+        if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            /* The client stays queued, so polling again would return at once */
+            if (errno == EMFILE || errno == ENFILE) usleep(ACCEPT_BACKOFF * 1000);
+            continue;
+        }
+        /* Resolving can itself run out of descriptors; the client is served regardless */
+        if (getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0) == 0)
+            printf("Accepted connection from (%s, %s)\n", hostname, port);
+        enqueue(connfd);
     }
 }
 
-void *thread(void *vargp) {
+/*
+ * accept_uring - accept connections with a single multishot accept, so
+ *     the kernel posts one completion per client without a new request.
+ *     Returns 0 after stop_accepting, or -1 if io_uring is unavailable or
+ *     fails, for the caller to go on with accept_loop.
+ */
+int accept_uring(int listenfd) {
+    uring r;
+    struct io_uring_cqe cqe;
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    char hostname[MAXLINE], port[MAXLINE];
+    int armed = 1, stopping = 0;
+
+    if (uring_init(&r, URING_ENTRIES) < 0) {
+        fprintf(stderr, "io_uring unavailable (%s), using accept\n", strerror(errno));
+        return -1;
+    }
+    uring_prep_accept_multishot(&r, listenfd, URING_ACCEPT);
+    uring_prep_poll(&r, wakefd[0], POLLIN, URING_WAKE);
+    while (armed) {
+        if (uring_submit(&r, 1) < 0) {
+            fprintf(stderr, "io_uring failed (%s), using accept\n", strerror(errno));
+            uring_deinit(&r);
+            return -1;
+        }
+        while (uring_peek(&r, &cqe)) {
+            if (cqe.user_data == URING_WAKE) {
+                /* Stop once the accept's final completion shows no client is left behind */
+                stopping = 1;
+                uring_prep_cancel(&r, URING_ACCEPT, URING_CANCEL);
+            }
+            if (cqe.user_data != URING_ACCEPT) continue;
+            if (cqe.res >= 0) {
+                clientlen = sizeof(clientaddr);
+                if (getpeername(cqe.res, (SA *)&clientaddr, &clientlen) == 0 &&
+                    getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0) == 0)
+                    printf("Accepted connection from (%s, %s)\n", hostname, port);
+                enqueue(cqe.res);
+            }
+            /* The kernel drops a multishot accept on error or overflow; re-arm it */
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                if (stopping) {
+                    armed = 0;
+                } else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                    /* Kernels before 5.19 have no multishot accept */
+                    fprintf(stderr, "io_uring cannot accept (%s), using accept\n", strerror(-cqe.res));
+                    uring_deinit(&r);
+                    return -1;
+                } else {
+                    if (cqe.res == -EMFILE || cqe.res == -ENFILE) usleep(ACCEPT_BACKOFF * 1000);
+                    uring_prep_accept_multishot(&r, listenfd, URING_ACCEPT);
+                }
+            }
+        }
+    }
+    uring_deinit(&r);
+    return 0;
+}
+
+/*
+ * enqueue - hand connfd to a worker, counting it until the worker closes
+ *     it. With several shards it goes to the queue of the node whose CPU
+ *     received its packets, as long as that node has workers.
+ */
+void enqueue(int connfd) {
+    int cpu, node = 0;
+    socklen_t len = sizeof(cpu);
+
+    if (nshards > 1 && getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+        node = numa_node_of(&topo, cpu);
+
+    P(&active_mutex);
+    active++;
+    V(&active_mutex);
+    /* set_workers cannot retire the node's last worker between the check and the insert */
+    P(&workers_mutex);
+    sbuf_insert(&queues[live_node(node)], connfd);
+    V(&workers_mutex);
+}
+
+/* live_node - node, or the next one after it that has workers; caller holds workers_mutex */
+int live_node(int node) {
+    while (!node_workers[node]) node = (node + 1) % nshards;
+    return node;
+}
+
+/*
+ * worker_cpu - CPU that worker id is pinned to with -p. Workers are dealt
+ *     to the nodes in turn, so every shard has workers filling it once
+ *     there are at least as many workers as nodes.
+ */
+int worker_cpu(int id) {
+    int node = id % topo.nnodes, ncpus = topo.first[node + 1] - topo.first[node];
+
+    return topo.cpus[topo.first[node] + (id / topo.nnodes) % ncpus];
+}
+
+int worker_node(int id) { return pin ? topo.node_of[worker_cpu(id)] : 0; }
+
+/*
+ * shard_get - cache_get against node's own shard first, then the others.
+ *     On a hit, *cp is the shard to pass to cache_read_done.
+ */
+int shard_get(int node, const char *key, char **obj, int *state, cache **cp) {
+    int size;
+
+    for (int i = 0; i < nshards; i++) {
+        *cp = shards[(node + i) % nshards];
+        if ((size = cache_get(*cp, key, obj, state)) > 0) return size;
+    }
+    return -1;
+}
+
+/* shard_add - cache obj in node's shard, dropping any copy another shard holds */
+void shard_add(int node, const char *key, char *obj, int size) {
+    for (int i = 1; i < nshards; i++) cache_invalidate(shards[(node + i) % nshards], key);
+    cache_add(shards[node], key, strlen(key), obj, size);
+}
+
+/* shard_set_limit - split cache_size evenly between the shards */
+void shard_set_limit(int cache_size) {
+    for (int i = 0; i < nshards; i++) cache_set_limit(shards[i], cache_size / nshards);
+}
+
+void stop_accepting(void) {
+    draining = 1;
+    if (write(wakefd[1], "", 1) < 0) unix_error("write error");
+}
+
+/*
+ * drain - give accepted connections up to DRAIN_TIMEOUT seconds to
+ *     finish. Keep-alive clients are sent Connection: close on their
+ *     next response; idle ones time out after KEEPALIVE_TIMEOUT.
+ */
+void drain(void) {
+    int n;
+
+    for (int i = 0; i < DRAIN_TIMEOUT * 10; i++) {
+        P(&active_mutex);
+        n = active;
+        V(&active_mutex);
+        if (!n) break;
+        usleep(100000);
+    }
+    if (!handed_off) save_snapshot();
+    printf("Drained, exiting\n");
+}
+
+/* save_snapshot - write the cache to the -c file, if one was given */
+void save_snapshot(void) {
+    int n;
+
+    if (!snapshot_path) return;
+    P(&snapshot_mutex);
+    if ((n = snapshot_save(snapshot_path, shards, nshards)) < 0)
+        fprintf(stderr, "saving %s failed: %s\n", snapshot_path, strerror(errno));
+    else
+        printf("Saved %d cached objects to %s\n", n, snapshot_path);
+    V(&snapshot_mutex);
+}
+
+/* set_workers - start or retire worker threads, newest first, until there are n */
+void set_workers(int n) {
+    pthread_t tid;
+    int node, fd, exits;
+
+    P(&workers_mutex);
+    for (; nworkers < n; nworkers++) {
+        node_workers[worker_node(nworkers)]++;
+        Pthread_create(&tid, NULL, thread, (void *)(long)nworkers);
+    }
+    for (; nworkers > n; nworkers--) {
+        node = worker_node(nworkers - 1);
+        if (--node_workers[node] == 0) {
+            /* Its last worker is leaving; connections still queued there go to a node that keeps workers */
+            exits = 0;
+            while (sbuf_tryremove(&queues[node], &fd) == 0) {
+                if (fd == WORKER_EXIT)
+                    exits++; /* Meant for another of this node's workers */
+                else
+                    sbuf_insert(&queues[live_node(node)], fd);
+            }
+            while (exits-- > 0) sbuf_insert(&queues[node], WORKER_EXIT);
+        }
+        sbuf_insert(&queues[node], WORKER_EXIT);
+    }
+    V(&workers_mutex);
+}
+
+/*
+ * load_config - read "name value" lines into cfg, where name is
+ *     cache_size, workers or origin_max_inflight and '#' starts a
+ *     comment. Returns -1 if the file cannot be read or has a bad line.
+ */
+int load_config(const char *path, proxy_config *cfg) {
+    FILE *fp;
+    char line[MAXLINE], name[MAXLINE];
+    int value, n, lineno = 0, rc = 0;
+
+    if (!(fp = fopen(path, "r"))) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp)) {
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        if ((n = sscanf(line, "%s %d", name, &value)) <= 0) continue; /* Blank line */
+        if (n == 2 && value > 0 && !strcmp(name, "cache_size"))
+            cfg->cache_size = value;
+        else if (n == 2 && value > 0 && value <= MAX_WORKERS && !strcmp(name, "workers"))
+            cfg->workers = value;
+        else if (n == 2 && value > 0 && !strcmp(name, "origin_max_inflight"))
+            cfg->max_inflight = value;
+        else {
+            fprintf(stderr, "%s:%d: bad setting\n", path, lineno);
+            rc = -1;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * signal_thread - SIGHUP reloads the config file and SIGUSR1 saves a
+ *     cache snapshot; SIGTERM and SIGINT drain and exit, and a second one
+ *     exits right away
+ */
+void *signal_thread(void *vargp) {
+    sigset_t mask;
+    int sig;
+    proxy_config cfg;
+
     Pthread_detach(pthread_self());
-    sbuf_t *sbuf = vargp;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGUSR1);
     while (1) {
-        int connfd = sbuf_remove(sbuf); /* Remove connfd from buf */
-        doit(connfd);                   /* Service client */
+        if (sigwait(&mask, &sig) != 0) continue;
+        if (sig == SIGUSR1) {
+            save_snapshot();
+            continue;
+        }
+        if (sig != SIGHUP) {
+            if (draining) exit(1);
+            stop_accepting();
+            continue;
+        }
+
+        cfg = config; /* A bad file leaves the running settings alone */
+        if (!config_path || load_config(config_path, &cfg) < 0) continue;
+        shard_set_limit(cfg.cache_size);
+        origin_table_set_limit(&origins, cfg.max_inflight);
+        set_workers(cfg.workers);
+        config = cfg;
+        printf("Reloaded %s: cache_size %d, workers %d, origin_max_inflight %d\n", config_path, cfg.cache_size,
+               cfg.workers, cfg.max_inflight);
+    }
+}
+
+/*
+ * control_thread - give the listening socket to the first successor
+ *     that asks for it on the control socket, then drain and exit. The
+ *     successor waits for the socket, so the cache is saved for it first.
+ */
+void *control_thread(void *vargp) {
+    int ctlfd = (int)(long)vargp, fd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((fd = handoff_wait(ctlfd)) < 0) continue;
+        save_snapshot();
+        if (handoff_give(fd, listenfd) == 0) break;
+        fprintf(stderr, "handoff failed: %s\n", strerror(errno));
+    }
+    handed_off = 1;
+    close(ctlfd);
+    printf("Handed the listening socket over, draining\n");
+    stop_accepting();
+    return NULL;
+}
+
+void *thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    int id = (int)(long)vargp;
+    worker_t w;
+    int connfd, keep;
+    struct timeval tv = {KEEPALIVE_TIMEOUT / 1000, (KEEPALIVE_TIMEOUT % 1000) * 1000};
+
+    /* Pin first, so the buffers below are first touched on the worker's own node */
+    if (pin && numa_pin_cpu(worker_cpu(id)) < 0) fprintf(stderr, "pinning worker %d failed\n", id);
+    w.node = worker_node(id);
+    w.up.fd = -1;
+    arena_init(&w.arena, ARENA_SIZE);
+    /* Reads from the origin land in obj_buf, so pin it once for the ring */
+    w.obj_buf = (char *)Malloc(MAX_OBJECT_SIZE);
+    w.use_ring = use_uring && uring_init(&w.ring, URING_ENTRIES) == 0;
+    if (w.use_ring && uring_register_buffer(&w.ring, w.obj_buf, MAX_OBJECT_SIZE) < 0) {
+        uring_deinit(&w.ring);
+        w.use_ring = 0;
+    }
+    if (use_uring && !w.use_ring) fprintf(stderr, "io_uring setup failed (%s), using Rio\n", strerror(errno));
+
+    while ((connfd = sbuf_remove(&queues[w.node])) != WORKER_EXIT) { /* Remove connfd from buf */
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); /* Bounds idle keep-alive */
+        rio_readinitb(&w.rio, connfd);
+        do {
+            keep = doit(&w, connfd); /* Service client, including pipelined requests */
+            arena_reset(&w.arena);
+        } while (keep);
+        rio_readfreeb(&w.rio);
         Close(connfd);
+        P(&active_mutex);
+        active--;
+        V(&active_mutex);
     }
+
+    /* Retired by a reload */
+    upstream_close(&w.up);
+    if (w.use_ring) uring_deinit(&w.ring);
+    arena_deinit(&w.arena);
+    Free(w.obj_buf);
+    return NULL;
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - handle one HTTP request/response transaction. Returns nonzero
+ *     if the connection may carry another request. Request-scoped memory
+ *     comes from w->arena, which the caller resets afterwards.
  */
 /* $begin doit */
-void doit(int fd) {
-    int proxy_fd;
+int doit(worker_t *w, int fd) {
+    int rc, size, state, keep;
     ssize_t n;
-    int size;
-    char buf[MAXLINE], method[MAXLINE], path[MAXLINE], version[MAXLINE], header[MAXLINE], obj_buf[MAX_OBJECT_SIZE];
-    char *obj;
-    rio_t rio, rio_proxy;
+    char *buf, *method, *path, *version, *header, *key, *line;
+    char *obj, *obj_buf = w->obj_buf;
+    rio_t *rio = &w->rio;
+    arena *a = &w->arena;
+    cache *shard;
+    http_uri *uri;
 
-    /* Read request line and headers */
-    rio_readinitb(&rio, fd);
-    if (!rio_readlineb(&rio, buf, MAXLINE))  // line:netp:doit:readrequest
-        return;
+    /* Read request line and headers; the line sizes the fields split from it */
+    if ((n = rio_peekline(rio, &line)) <= 0)  // line:netp:doit:readrequest
+        return 0;
+    buf = arena_strndup(a, line, n);
+    rio_consumeb(rio, n);
+    method = (char *)arena_alloc(a, n + 1);
+    path = (char *)arena_alloc(a, n + 1);
+    version = (char *)arena_alloc(a, n + 1);
+    header = (char *)arena_alloc(a, MAXLINE);
+    uri = (http_uri *)arena_alloc(a, sizeof(http_uri));
+    if (!buf || !method || !path || !version || !header || !uri) {
+        clienterror(fd, "request too large", "500", "Internal Server Error", "Proxy ran out of request memory");
+        return 0;
+    }
     printf("%s", buf);
+    *method = *path = *version = '\0';
     sscanf(buf, "%s %s %s", method, path, version);  // line:netp:doit:parserequest
-    if (strcasecmp(method, "GET")) {                 // line:netp:doit:beginrequesterr
+    if (!strcasecmp(method, "CONNECT")) {
+        if (!tunnel_admit()) {
+            clienterror(fd, path, "503", "Service Unavailable", "Proxy has no worker to spare for another tunnel");
+            return 0;
+        }
+        connect_tunnel(fd, rio, path);
+        tunnel_done();
+        return 0;
+    }
+    if (strcasecmp(method, "GET")) {  // line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented", "Proxy does not implement this method");
-        return;
+        return 0;
     }  // line:netp:doit:endrequesterr
 
     /* Parse URI from GET request */
-    http_uri uri;
-    if (parse_uri(path, &uri) < 0) {
+    if (parse_uri(path, uri) < 0) {
         clienterror(fd, "uri should begin with http://", "400", "Bad Request", "Proxy failed to parse the scheme");
-        return;
+        return 0;
     }
 
-    if (read_requesthdrs(&rio, header, &uri) < 0) {
+    keep = !strcasecmp(version, "HTTP/1.1"); /* Persistent by default from HTTP/1.1 on */
+    if (read_requesthdrs(rio, header, uri, &keep) < 0) {
         clienterror(fd, "read fd error", "400", "Bad Request", "Proxy failed to parse the HTTP header");
-        return;
+        return 0;
     }
+    if (draining) keep = 0;
+    /* The io_uring relay reads to EOF, so it cannot leave the origin connection open */
+    strcat(header, w->use_ring ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
 
-    sprintf(path, "http://%s:%d%s", uri.hostname, uri.port, uri.abs_path);
+    if (!(key = arena_printf(a, "http://%s:%d%s", uri->hostname, uri->port, uri->abs_path))) {
+        clienterror(fd, "request too large", "500", "Internal Server Error", "Proxy ran out of request memory");
+        return 0;
+    }
 
-    /* Read cache */
-    if ((size = cache_get(&c, path, &obj)) > 0) {
-        if (rio_writen(fd, obj, size) < 0) {
-            clienterror(fd, "write error", "500", "Internal Server Error", "Proxy failed to forward the request");
+    /* Read cache; fresh and stale-while-revalidate hits never touch the origin here */
+    if ((size = shard_get(w->node, key, &obj, &state, &shard)) > 0) {
+        if (state != CACHE_EXPIRED) {
+            if (state == CACHE_REVALIDATE) refresh(uri, header, key, w->node);
+            keep = serve_cached(fd, obj, size, keep);
+            cache_read_done(shard);
+            return keep;
         }
-        cache_read_done(&c);
+        cache_read_done(shard);
+    }
+
+    if (w->use_ring) {
+        rc = fetch_uring(w, uri, header, fd, &size);
+        keep = 0; /* The origin's own Connection header went through unchanged */
+        if (rc == FETCH_OK && size < MAX_OBJECT_SIZE) size = strip_hop_headers(obj_buf, size);
     } else {
-        sprintf(buf, "%d", uri.port);
-        proxy_fd = open_clientfd(uri.hostname, buf);
-        if (proxy_fd < 0) {
-            clienterror(fd, strerror(errno), "500", "Internal Server Error", "Proxy failed to connect the host");
-            return;
+        rc = fetch(&w->up, uri, header, fd, &keep, obj_buf, &size);
+    }
+    if (rc == FETCH_OK) {
+        if (size < MAX_OBJECT_SIZE) {
+            shard_add(w->node, key, obj_buf, size);
         }
+        return keep;
+    }
+    if (rc == FETCH_CLIENT) return 0;
 
-        rio_readinitb(&rio_proxy, proxy_fd);
-        if (rio_writen(proxy_fd, header, strlen(header)) < 0) {
-            clienterror(fd, "write error", "500", "Internal Server Error", "Proxy failed to forward the request");
-            return;
-        }
-        size = 0;
-        while ((n = rio_readlineb(&rio_proxy, buf, MAXLINE))) {
-            if (rio_writen(fd, buf, n) < 0) {
-                clienterror(fd, "write error", "500", "Internal Server Error", "Proxy failed to forward the request");
-                return;
-            }
-            if (size + n < MAX_OBJECT_SIZE) {
-                memcpy(obj_buf + size, buf, n);
+    /* The origin failed before anything was relayed; fall back to any stale copy */
+    if ((size = shard_get(w->node, key, &obj, &state, &shard)) > 0) {
+        keep = serve_cached(fd, obj, size, keep);
+        cache_read_done(shard);
+        return keep;
+    } else if (rc == FETCH_BUSY) {
+        clienterror(fd, uri->hostname, "503", "Service Unavailable", "Proxy is shedding load for this host");
+    } else if (rc == FETCH_CONNECT) {
+        clienterror(fd, strerror(errno), "502", "Bad Gateway", "Proxy failed to connect the host");
+    } else if (rc == FETCH_ORIGIN) {
+        clienterror(fd, strerror(errno), "504", "Gateway Timeout", "Proxy gave up waiting for the host");
+    }
+    return 0;
+}
+/* $end doit */
+
+/*
+ * connect_tunnel - serve CONNECT host:port by opening a raw connection to
+ *     the target and relaying bytes both ways until either side is done
+ */
+void connect_tunnel(int fd, rio_t *rio, char *target) {
+    static const char *established = "HTTP/1.1 200 Connection established\r\n\r\n";
+    char *colon, *line, *host = target;
+    int port, proxy_fd, rc, probe;
+    ssize_t n;
+    origin *o;
+
+    /* The request headers only matter to us; drop them */
+    while ((n = rio_peekline(rio, &line)) > 0) {
+        rio_consumeb(rio, n);
+        if (n == 2 && !memcmp(line, "\r\n", 2)) break;
+    }
+    if (n <= 0) return;
+
+    if (!(colon = strrchr(target, ':')) || (port = atoi(colon + 1)) <= 0 || port > 65535) {
+        clienterror(fd, target, "400", "Bad Request", "CONNECT target must be host:port");
+        return;
+    }
+    *colon = '\0';
+    if (host[0] == '[' && colon[-1] == ']') { /* [IPv6 literal] */
+        host++;
+        colon[-1] = '\0';
+    }
+
+    if ((rc = origin_acquire(&origins, host, port, &o, &probe)) != ORIGIN_OK) {
+        clienterror(fd, host, "503", "Service Unavailable", "Proxy is shedding load for this host");
+        return;
+    }
+    proxy_fd = origin_connect(host, port);
+    /* A tunnel can live for minutes; it only holds the origin slot while connecting */
+    origin_release(&origins, o, probe, proxy_fd >= 0);
+    if (proxy_fd < 0) {
+        clienterror(fd, strerror(errno), "502", "Bad Gateway", "Proxy failed to connect the host");
+        return;
+    }
+
+    /* Bytes the client sent right behind the request (e.g. a TLS hello) are already buffered */
+    if (rio_writen(fd, (void *)established, strlen(established)) < 0 ||
+        (rio->rio_cnt > 0 && rio_writen(proxy_fd, rio->rio_bufptr, rio->rio_cnt) < 0)) {
+        close(proxy_fd);
+        return;
+    }
+    rio_consumeb(rio, rio->rio_cnt);
+
+    tunnel_relay(fd, proxy_fd);
+    close(proxy_fd);
+}
+
+/*
+ * tunnel_admit - count a new tunnel, unless tunnels already hold their
+ *     share of the workers. A tunnel keeps its worker for as long as it
+ *     lasts, so without a cap a few long-lived ones would starve HTTP.
+ */
+int tunnel_admit(void) {
+    int ok;
+
+    P(&active_mutex);
+    if ((ok = tunnels < nworkers / TUNNEL_SHARE)) tunnels++;
+    V(&active_mutex);
+    return ok;
+}
+
+void tunnel_done(void) {
+    P(&active_mutex);
+    tunnels--;
+    V(&active_mutex);
+}
+
+/*
+ * fetch - forward header to the origin named by uri and relay its
+ *     response to fd (skipped when fd < 0), keeping a copy in obj_buf
+ *     while it fits. *sizep is set to the full response size; a value
+ *     >= MAX_OBJECT_SIZE means obj_buf holds only a prefix.
+ *
+ *     The response is framed by Content-Length or chunked encoding, so
+ *     the origin connection goes back to up when it ends cleanly. Its
+ *     hop-by-hop headers are replaced with a Connection header for the
+ *     client; *keepp says whether the client may send another request
+ *     and is cleared if the response can only be ended by closing.
+ *
+ *     FETCH_ORIGIN is only returned if nothing reached the client, so
+ *     the caller may still answer with an error page or a stale copy.
+ */
+int fetch(upstream_t *up, http_uri *uri, char *header, int fd, int *keepp, char *obj_buf, int *sizep) {
+    int size = 0, rc = FETCH_OK, reused, minor, status, chunked = 0, origin_keep, leftover, sent = 0, probe;
+    long length = -1;
+    ssize_t n;
+    char *line, *conn;
+    rio_t rio_proxy;
+    struct iovec iov[2];
+    origin *o;
+
+    if (origin_acquire(&origins, uri->hostname, uri->port, &o, &probe) != ORIGIN_OK) return FETCH_BUSY;
+
+    /* Reuse the idle connection if it leads to the same origin; should it turn out dead, reconnect once */
+    reused = up->fd >= 0 && up->port == uri->port && !strcasecmp(up->hostname, uri->hostname);
+    if (!reused) upstream_close(up);
+    while (1) {
+        if (up->fd < 0) {
+            if ((up->fd = origin_connect(uri->hostname, uri->port)) < 0) {
+                origin_release(&origins, o, probe, 0);
+                return FETCH_CONNECT;
             }
+            strcpy(up->hostname, uri->hostname);
+            up->port = uri->port;
+        }
+        rio_readinitb_size(&rio_proxy, up->fd, ORIGIN_RIO_SIZE);
+        if (rio_writen(up->fd, header, strlen(header)) >= 0 && (n = rio_peekline(&rio_proxy, &line)) > 0) break;
+        rio_readfreeb(&rio_proxy);
+        upstream_close(up);
+        if (!reused) {
+            origin_release(&origins, o, probe, 0);
+            return FETCH_ORIGIN;
+        }
+        reused = 0;
+    }
+
+    /* Status line, answered in our own protocol version */
+    if (n < 8 || sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) {
+        rc = FETCH_ORIGIN;
+        goto done;
+    }
+    origin_keep = minor >= 1;
+    memcpy(obj_buf, "HTTP/1.1", 8);
+    memcpy(obj_buf + 8, line + 8, n - 8);
+    size = n;
+    rio_consumeb(&rio_proxy, n);
+
+    /* Header lines: note the framing, drop hop-by-hop ones, copy the rest */
+    while ((n = rio_peekline(&rio_proxy, &line)) > 0) {
+        if (n == 2 && !memcmp(line, "\r\n", 2)) break;
+        if (header_is(line, HEADER_CONTENT_LENGTH)) length = atol(line + strlen(HEADER_CONTENT_LENGTH));
+        if (header_is(line, HEADER_TRANSFER_ENCODING)) chunked = header_has(line, n, "chunked");
+        if (header_is(line, HEADER_CONNECTION)) {
+            if (header_has(line, n, "close")) origin_keep = 0;
+            if (header_has(line, n, "keep-alive")) origin_keep = 1;
+        }
+        if (size + n + 2 >= MAX_OBJECT_SIZE) break; /* Refuse absurd headers */
+        if (!header_is(line, HEADER_CONNECTION) && !header_is(line, HEADER_KEEP_ALIVE) &&
+            !header_is(line, HEADER_PROXY_CONNECTION)) {
+            memcpy(obj_buf + size, line, n);
             size += n;
         }
-        if (size < MAX_OBJECT_SIZE) {
-            cache_add(&c, path, strlen(path), obj_buf, size);
+        rio_consumeb(&rio_proxy, n);
+    }
+    if (n <= 0 || size + n + 2 >= MAX_OBJECT_SIZE) {
+        rc = FETCH_ORIGIN;
+        goto done;
+    }
+    rio_consumeb(&rio_proxy, n);
+    memcpy(obj_buf + size, "\r\n", 2);
+    size += 2;
+
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        length = 0; /* Never has a body */
+        chunked = 0;
+    }
+    if (!chunked && length < 0) origin_keep = *keepp = 0; /* Ends when the origin closes */
+
+    /* Send the header with our Connection line in place of the blank line */
+    conn = *keepp ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    iov[0].iov_base = obj_buf;
+    iov[0].iov_len = size - 2;
+    iov[1].iov_base = conn;
+    iov[1].iov_len = strlen(conn);
+    if (fd >= 0 && rio_writev(fd, iov, 2) < 0) {
+        rc = FETCH_CLIENT;
+        goto done;
+    }
+    sent = 1;
+
+    if (chunked)
+        rc = relay_chunked(&rio_proxy, fd, obj_buf, &size);
+    else
+        rc = relay_body(&rio_proxy, fd, obj_buf, &size, length);
+
+done:
+    leftover = rio_proxy.rio_cnt;
+    rio_readfreeb(&rio_proxy);
+    origin_release(&origins, o, probe, rc != FETCH_ORIGIN);
+    if (rc != FETCH_OK || !origin_keep || leftover) upstream_close(up);
+
+    *sizep = size;
+    if (rc == FETCH_ORIGIN && sent && fd >= 0) rc = FETCH_CLIENT; /* Too late for an error page */
+    if (rc != FETCH_OK) *keepp = 0;
+    return rc;
+}
+
+/*
+ * relay_body - relay len bytes (everything up to EOF if len < 0) from rp
+ *     to fd, appending them to the copy in obj_buf while it fits
+ */
+int relay_body(rio_t *rp, int fd, char *obj_buf, int *sizep, long len) {
+    int size = *sizep, rc = FETCH_OK;
+    ssize_t n;
+    size_t want;
+    char *data;
+
+    /* Reads land in obj_buf directly; once the object outgrows the cache it is just scratch space */
+    while (len != 0) {
+        data = size < MAX_OBJECT_SIZE ? obj_buf + size : obj_buf;
+        want = size < MAX_OBJECT_SIZE ? MAX_OBJECT_SIZE - size : MAX_OBJECT_SIZE;
+        if (len > 0 && want > len) want = len;
+        if ((n = rio_readsomeb(rp, data, want)) <= 0) {
+            if (n < 0 || len > 0) rc = FETCH_ORIGIN; /* Only a body without a length may end at EOF */
+            break;
+        }
+        if (fd >= 0 && rio_writen(fd, data, n) < 0) {
+            rc = FETCH_CLIENT;
+            break;
+        }
+        size += n;
+        if (len > 0) len -= n;
+    }
+    *sizep = size;
+    return rc;
+}
+
+/*
+ * relay_chunked - relay a chunked body, framing included, up to and
+ *     including the blank line that ends its trailers
+ */
+int relay_chunked(rio_t *rp, int fd, char *obj_buf, int *sizep) {
+    int rc = FETCH_OK, last = 0;
+    long len;
+    ssize_t n;
+    char *line, *end;
+
+    while (rc == FETCH_OK) {
+        if ((n = rio_peekline(rp, &line)) <= 0 || line[n - 1] != '\n') return FETCH_ORIGIN;
+        if (*sizep + n < MAX_OBJECT_SIZE) memcpy(obj_buf + *sizep, line, n);
+        *sizep += n;
+        if (fd >= 0 && rio_writen(fd, line, n) < 0) return FETCH_CLIENT;
+        rio_consumeb(rp, n);
+
+        if (last) {
+            if (n == 2 && !memcmp(line, "\r\n", 2)) break; /* End of trailers */
+        } else if (!isxdigit((unsigned char)line[0]) || (len = strtol(line, &end, 16)) < 0 ||
+                   (*end != ';' && *end != '\r' && *end != '\n') || len > INT_MAX - 2 - *sizep) {
+            rc = FETCH_ORIGIN; /* Not a chunk size, or more than the size count can hold */
+        } else if (len == 0) {
+            last = 1;
+        } else {
+            rc = relay_body(rp, fd, obj_buf, sizep, len + 2); /* Chunk data and its CRLF */
         }
+    }
+    return rc;
+}
+
+void upstream_close(upstream_t *up) {
+    if (up->fd >= 0) close(up->fd);
+    up->fd = -1;
+}
+
+/*
+ * serve_cached - send a cached response, adding the Connection header
+ *     and, for responses that were framed by the origin closing, a
+ *     Content-Length. Returns keep if it was sent, otherwise 0.
+ */
+int serve_cached(int fd, char *obj, int size, int keep) {
+    char extra[MAXLINE], *p = obj, *eol;
+    int framed = 0, len = 0;
+    struct iovec iov[3];
+
+    /* Find the blank line ending the header, noting its framing on the way */
+    while ((eol = memchr(p, '\n', obj + size - p)) && eol - p > 1) {
+        if (header_is(p, HEADER_CONTENT_LENGTH) || header_is(p, HEADER_TRANSFER_ENCODING)) framed = 1;
+        p = eol + 1;
+    }
+    if (!eol) {
+        rio_writen(fd, obj, size);
+        return 0;
+    }
+
+    if (!framed) len = sprintf(extra, "Content-Length: %d\r\n", (int)(obj + size - eol - 1));
+    sprintf(extra + len, "Connection: %s\r\n\r\n", keep ? "keep-alive" : "close");
+    iov[0].iov_base = obj;
+    iov[0].iov_len = p - obj;
+    iov[1].iov_base = extra;
+    iov[1].iov_len = strlen(extra);
+    iov[2].iov_base = eol + 1;
+    iov[2].iov_len = obj + size - eol - 1;
+    return rio_writev(fd, iov, 3) < 0 ? 0 : keep;
+}
+
+/*
+ * strip_hop_headers - remove Connection, Keep-Alive and Proxy-Connection
+ *     from the header of a response held in obj; returns the new size
+ */
+int strip_hop_headers(char *obj, int size) {
+    char *p = obj, *eol;
+
+    while ((eol = memchr(p, '\n', obj + size - p)) && eol - p > 1) {
+        if (header_is(p, HEADER_CONNECTION) || header_is(p, HEADER_KEEP_ALIVE) ||
+            header_is(p, HEADER_PROXY_CONNECTION)) {
+            memmove(p, eol + 1, obj + size - eol - 1);
+            size -= eol + 1 - p;
+        } else {
+            p = eol + 1;
+        }
+    }
+    return size;
+}
+
+/* header_is - does the header line begin with name (e.g. "Host:")? */
+int header_is(const char *line, const char *name) { return !strncasecmp(line, name, strlen(name)); }
+
+/* header_has - does the n-byte header line mention token, case ignored? */
+int header_has(const char *line, size_t n, const char *token) {
+    size_t len = strlen(token);
+
+    for (size_t i = 0; i + len <= n; i++) {
+        if (!strncasecmp(line + i, token, len)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * fetch_uring - fetch through w's ring. The connect, its deadline and the
+ *     request are submitted as one linked chain; after that every round
+ *     trip sends the previous chunk to the client linked to a fixed-buffer
+ *     read of the next one, so each chunk costs a single system call.
+ *     Reads land in w->obj_buf, the ring's registered buffer. Same contract
+ *     as fetch; should the ring itself fail, it is shut down with
+ *     ring_down and the request fails as if the origin had broken off.
+ */
+int fetch_uring(worker_t *w, http_uri *uri, char *header, int fd, int *sizep) {
+    struct __kernel_timespec connect_ts = {ORIGIN_CONNECT_TIMEOUT / 1000, (ORIGIN_CONNECT_TIMEOUT % 1000) * 1000000};
+    struct __kernel_timespec io_ts = {ORIGIN_IO_TIMEOUT / 1000, (ORIGIN_IO_TIMEOUT % 1000) * 1000000};
+    struct addrinfo hints, *listp;
+    uring *r = &w->ring;
+    int proxy_fd, size = 0, rc = FETCH_OK, nsqe, sent, got, broken = 1, len = strlen(header), probe, res[URING_TAGS];
+    ssize_t n = 0;
+    size_t want;
+    char portstr[16], *data = NULL, *dst, *obj_buf = w->obj_buf;
+    origin *o;
+
+    if (origin_acquire(&origins, uri->hostname, uri->port, &o, &probe) != ORIGIN_OK) return FETCH_BUSY;
+
+    /* Only the first address is tried; there is no cheap way to fall through a linked chain */
+    sprintf(portstr, "%d", uri->port);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(uri->hostname, portstr, &hints, &listp) != 0) {
+        origin_release(&origins, o, probe, 0);
+        errno = EHOSTUNREACH;
+        return FETCH_CONNECT;
+    }
+    if ((proxy_fd = socket(listp->ai_family, listp->ai_socktype, listp->ai_protocol)) < 0) {
+        freeaddrinfo(listp);
+        origin_release(&origins, o, probe, 0);
+        return FETCH_CONNECT;
+    }
+
+    /* Room for the whole chain is reserved first, so no uring_prep_* below returns NULL */
+    if (uring_reserve(r, 3) == 0) {
+        uring_prep_connect(r, proxy_fd, listp->ai_addr, listp->ai_addrlen, URING_CONNECT)->flags |= IOSQE_IO_LINK;
+        uring_prep_link_timeout(r, &connect_ts, URING_TIMEOUT)->flags |= IOSQE_IO_LINK;
+        uring_prep_send(r, proxy_fd, header, len, URING_SEND);
+        broken = uring_submit(r, 3) != 3 || reap_chain(r, 3, res) < 0;
+    }
+    if (broken) {
+        ring_down(w);
+        freeaddrinfo(listp);
+        origin_release(&origins, o, probe, ORIGIN_NO_VERDICT); /* Not the origin's fault */
+        close(proxy_fd);
+        return FETCH_ORIGIN;
+    }
+    freeaddrinfo(listp);
+    /* A connect that timed out was cancelled by its link timeout */
+    got = res[URING_CONNECT] == -ECANCELED ? -ETIMEDOUT : res[URING_CONNECT];
+    sent = res[URING_SEND];
+    if (got < 0) {
+        origin_release(&origins, o, probe, 0);
+        close(proxy_fd);
+        errno = -got;
+        return FETCH_CONNECT;
+    }
+    if (sent < 0 || (sent < len && rio_writen(proxy_fd, header + sent, len - sent) < 0)) {
+        origin_release(&origins, o, probe, 0);
         close(proxy_fd);
+        errno = sent < 0 ? -sent : errno;
+        return FETCH_ORIGIN;
+    }
+
+    /*
+     * The response is relayed raw. While it fits, each read lands right
+     * behind the previous chunk; past MAX_OBJECT_SIZE reads reuse the start
+     * of obj_buf, which is safe because the send of the chunk before it is
+     * linked ahead of the read.
+     */
+    while (1) {
+        dst = size < MAX_OBJECT_SIZE ? obj_buf + size : obj_buf;
+        want = size < MAX_OBJECT_SIZE ? MAX_OBJECT_SIZE - size : MAX_OBJECT_SIZE;
+        nsqe = n > 0 && fd >= 0 ? 3 : 2;
+        if ((broken = uring_reserve(r, nsqe) < 0)) break;
+        if (nsqe == 3) uring_prep_send(r, fd, data, n, URING_SEND)->flags |= IOSQE_IO_LINK;
+        uring_prep_read_fixed(r, proxy_fd, dst, want, URING_READ)->flags |= IOSQE_IO_LINK;
+        uring_prep_link_timeout(r, &io_ts, URING_TIMEOUT);
+        res[URING_SEND] = n;
+        if ((broken = uring_submit(r, nsqe) != nsqe || reap_chain(r, nsqe, res) < 0)) break;
+        sent = res[URING_SEND];
+        got = res[URING_READ];
+
+        /* A short send breaks the chain and cancels the read; finish the chunk and read again */
+        if (sent < 0 || (sent < n && rio_writen(fd, data + sent, n - sent) < 0)) {
+            rc = FETCH_CLIENT;
+            break;
+        }
+        if (sent < n && got == -ECANCELED) {
+            n = 0;
+            continue;
+        }
+        if (got <= 0) {
+            n = got;
+            if (got < 0) errno = got == -ECANCELED ? ETIMEDOUT : -got;
+            break;
+        }
+        data = dst;
+        n = got;
+        size += n;
+    }
+    if (broken) {
+        ring_down(w);
+        n = -1;
     }
+    origin_release(&origins, o, probe, rc == FETCH_CLIENT || (n == 0 && size > 0));
+    close(proxy_fd);
+
+    *sizep = size;
+    if (rc == FETCH_OK && (n < 0 || !size)) rc = size && fd >= 0 ? FETCH_CLIENT : FETCH_ORIGIN;
+    return rc;
 }
-/* $end doit */
 
-int read_requesthdrs(rio_t *rio, char *header, http_uri *uri) {
+/*
+ * ring_down - shut down w's ring after an error that leaves its state
+ *     unknown; w goes through Rio from then on. errno is preserved.
+ */
+void ring_down(worker_t *w) {
+    int err = errno;
+
+    fprintf(stderr, "io_uring failed (%s), using Rio\n", strerror(err));
+    uring_deinit(&w->ring);
+    w->use_ring = 0;
+    errno = err;
+}
+
+/*
+ * reap_chain - wait for the n completions of the chain just submitted and
+ *     store their results in res, indexed by user_data tag. Every entry of
+ *     a chain completes, cancelled ones included; any left on the ring
+ *     would be taken by the next request as its own.
+ */
+int reap_chain(uring *r, int n, int *res) {
+    struct io_uring_cqe cqe;
+
+    while (n-- > 0) {
+        if (uring_wait(r, &cqe) < 0) return -1;
+        if (cqe.user_data < URING_TAGS) res[cqe.user_data] = cqe.res;
+    }
+    return 0;
+}
+
+/*
+ * refresh - revalidate a stale cache entry on a detached thread so the
+ *     request that noticed it can be answered from cache right away. At
+ *     most MAX_REFRESHES run at once; past that the entry stays stale and
+ *     the cache hands its refresh to a request CACHE_REVALIDATE_RETRY later.
+ */
+void refresh(http_uri *uri, char *header, char *path, int node) {
+    pthread_t tid;
+    refresh_args *args;
+
+    P(&active_mutex);
+    if (refreshes >= MAX_REFRESHES) {
+        V(&active_mutex);
+        return;
+    }
+    refreshes++;
+    V(&active_mutex);
+
+    args = (refresh_args *)Malloc(sizeof(refresh_args));
+    args->uri = *uri;
+    args->header = strdup(header);
+    args->path = strdup(path);
+    args->node = node; /* The thread also inherits the caller's CPU affinity */
+    Pthread_create(&tid, NULL, refresh_thread, args);
+}
+
+void *refresh_thread(void *vargp) {
+    refresh_args *args = vargp;
+    char *obj_buf = (char *)Malloc(MAX_OBJECT_SIZE);
+    int size, keep = 0;
+    upstream_t up = {-1};
+
+    Pthread_detach(pthread_self());
+    if (fetch(&up, &args->uri, args->header, -1, &keep, obj_buf, &size) == FETCH_OK && size < MAX_OBJECT_SIZE) {
+        shard_add(args->node, args->path, obj_buf, size);
+    }
+    upstream_close(&up);
+    Free(obj_buf);
+    Free(args->header);
+    Free(args->path);
+    Free(args);
+    P(&active_mutex);
+    refreshes--;
+    V(&active_mutex);
+    return NULL;
+}
+
+/*
+ * read_requesthdrs - build the request for the origin in header, leaving
+ *     off the Connection line and the blank line that end it. *keepp
+ *     starts as the default for the client's HTTP version and is updated
+ *     from its Connection headers.
+ */
+int read_requesthdrs(rio_t *rio, char *header, http_uri *uri, int *keepp) {
     ssize_t size;
+    size_t len;
     uint8_t host_exist = 0;
-    char buf[MAXLINE];
+    char *line;
 
-    sprintf(header, "GET %s HTTP/1.0\r\n", uri->abs_path);
+    len = sprintf(header, "GET %s HTTP/1.1\r\n", uri->abs_path);
 
-    while ((size = rio_readlineb(rio, buf, MAXLINE)) > 0) {
-        if (!strcmp(buf, "\r\n")) break;
+    /* Inspect each header in place; only the ones we forward are copied */
+    while ((size = rio_peekline(rio, &line)) > 0) {
+        rio_consumeb(rio, size);
+        if (size == 2 && !memcmp(line, "\r\n", 2)) break;
 
-        if (!strncasecmp(buf, HEADER_HOST, strlen(HEADER_HOST))) {
+        if (header_is(line, HEADER_HOST)) {
             host_exist = 1;
         }
-        if (!strncasecmp(buf, HEADER_USER_AGENT, strlen(HEADER_USER_AGENT)) ||
-            !strncasecmp(buf, HEADER_CONNECTION, strlen(HEADER_CONNECTION)) ||
-            !strncasecmp(buf, HEADER_PROXY_CONNECTION, strlen(HEADER_PROXY_CONNECTION)))
+        if (header_is(line, HEADER_CONNECTION) || header_is(line, HEADER_PROXY_CONNECTION)) {
+            if (header_has(line, size, "close")) *keepp = 0;
+            if (header_has(line, size, "keep-alive")) *keepp = 1;
+        }
+        /* A request body is not forwarded, so it would be misread as the next request */
+        if (header_is(line, HEADER_CONTENT_LENGTH) || header_is(line, HEADER_TRANSFER_ENCODING)) *keepp = 0;
+        if (header_is(line, HEADER_USER_AGENT) || header_is(line, HEADER_CONNECTION) ||
+            header_is(line, HEADER_PROXY_CONNECTION) || header_is(line, HEADER_KEEP_ALIVE))
             continue;
-        strcat(header, buf);
+        if (len + size >= MAXLINE - 256) return -1; /* Leave room for the headers added below */
+        memcpy(header + len, line, size);
+        len += size;
     }
 
     if (size < 0) return -1;
-    if (!host_exist) sprintf(header + strlen(header), "Host: %s\r\n", uri->hostname);
+    header[len] = '\0';
+    if (!host_exist) sprintf(header + len, "Host: %s\r\n", uri->hostname);
 
     strcat(header, user_agent_hdr);
-    strcat(header, "Connection: close\r\n");
-    strcat(header, "Proxy-Connection: close\r\n");
-    strcat(header, "\r\n");
     return 0;
 }
 
@@ -226,28 +1310,29 @@ int parse_uri(char *path, http_uri *uri) {
  */
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXLINE];
-
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Proxy Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf,
-            "<body bgcolor="
-            "ffffff"
-            ">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Proxy Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    char status[MAXLINE], msg[MAXLINE], detail[MAXLINE];
+    struct iovec iov[7];
+
+    /* Format the variable parts of the HTTP response headers and body */
+    sprintf(status, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    sprintf(msg, "%s: %s\r\n", errnum, shortmsg);
+    sprintf(detail, "<p>%s: %s\r\n", longmsg, cause);
+
+    /* Send them with the constant parts in one system call */
+    char *frags[] = {status,
+                     "Content-type: text/html\r\n\r\n",
+                     "<html><title>Proxy Error</title>",
+                     "<body bgcolor="
+                     "ffffff"
+                     ">\r\n",
+                     msg,
+                     detail,
+                     "<hr><em>The Proxy Web server</em>\r\n"};
+    for (int i = 0; i < 7; i++) {
+        iov[i].iov_base = frags[i];
+        iov[i].iov_len = strlen(frags[i]);
+    }
+    rio_writev(fd, iov, 7);
 }
 /* $end clienterror */
 
@@ -282,4 +1367,14 @@ int sbuf_remove(sbuf_t *sp) {
     V(&sp->mutex);                           /* Unlock the buffer */
     V(&sp->slots);                           /* Announce available slot */
     return item;
+}
+
+/* Remove the first item from buffer sp into *itemp; -1 if it is empty */
+int sbuf_tryremove(sbuf_t *sp, int *itemp) {
+    if (sem_trywait(&sp->items) < 0) return -1; /* Take an item only if one is there */
+    P(&sp->mutex);
+    *itemp = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "snapshot.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static int snapshot_write(FILE *fp, const void *buf, size_t n, uint64_t *sum);
+
+/*
+ * snapshot_save - write every shard to path, each from its LRU end so
+ *     that loading re-creates the recency order. The file is written
+ *     under a temporary name and renamed into place, so a reader never
+ *     sees half of it. Each shard is locked against readers while it is
+ *     written out. Returns the number of entries saved, or -1.
+ */
+int snapshot_save(const char *path, cache **shards, int nshards) {
+    char tmp[MAXLINE];
+    FILE *fp;
+    snapshot_header hdr;
+    snapshot_entry e;
+    uint64_t sum = FNV_OFFSET;
+    int rc = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (!(fp = fopen(tmp, "w"))) return -1;
+    memset(&hdr, 0, sizeof(hdr));
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) rc = -1;
+
+    for (int i = 0; i < nshards && rc == 0; i++) {
+        cache *c = shards[i];
+        P(&c->write);
+        for (cache_item *item = c->root->prev; item != c->root && rc == 0; item = item->prev) {
+            memset(&e, 0, sizeof(e));
+            e.uri_size = strlen(item->uri);
+            e.obj_size = item->size;
+            e.fetched = item->fetched;
+            e.shard = i;
+            if (snapshot_write(fp, &e, sizeof(e), &sum) < 0 || snapshot_write(fp, item->uri, e.uri_size, &sum) < 0 ||
+                snapshot_write(fp, item->obj, e.obj_size, &sum) < 0)
+                rc = -1;
+            hdr.count++;
+            hdr.length += sizeof(e) + e.uri_size + e.obj_size;
+        }
+        V(&c->write);
+    }
+
+    /* The header goes in last, once the checksum is known */
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.shards = nshards;
+    hdr.checksum = sum;
+    if (rc == 0 && (fseek(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1)) rc = -1;
+    if (fclose(fp) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, path) < 0) rc = -1;
+    if (rc < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return hdr.count;
+}
+
+/*
+ * snapshot_load - map the snapshot at path and add its entries to the
+ *     shards they were saved from, oldest first. A file that is truncated
+ *     or fails its checksum is rejected whole. Entries past
+ *     CACHE_MAX_STALE_IF_ERROR are skipped. Returns the number of entries
+ *     loaded, -1 (errno EINVAL for a damaged file), or SNAPSHOT_SHARDS if
+ *     it was saved with a different number of shards: merging or
+ *     splitting shards would lose the recency order between them.
+ */
+int snapshot_load(const char *path, cache **shards, int nshards) {
+    struct stat sbuf;
+    snapshot_header hdr;
+    snapshot_entry e;
+    char *map, *p, *end;
+    uint64_t sum = FNV_OFFSET;
+    time_t now = time(NULL);
+    int fd, n = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < (off_t)sizeof(hdr) ||
+        (map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    memcpy(&hdr, map, sizeof(hdr));
+    end = map + sbuf.st_size;
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) || hdr.length != sbuf.st_size - sizeof(hdr)) {
+        munmap(map, sbuf.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    for (p = map + sizeof(hdr); p < end; p++) sum = (sum ^ (unsigned char)*p) * FNV_PRIME;
+    if (sum != hdr.checksum) {
+        munmap(map, sbuf.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    if (hdr.shards != nshards) {
+        munmap(map, sbuf.st_size);
+        return SNAPSHOT_SHARDS;
+    }
+
+    madvise(map, sbuf.st_size, MADV_SEQUENTIAL);
+    for (p = map + sizeof(hdr); p + sizeof(e) <= end; p += sizeof(e) + e.uri_size + e.obj_size) {
+        memcpy(&e, p, sizeof(e));
+        if (e.uri_size + (size_t)e.obj_size > (size_t)(end - p) - sizeof(e) || e.shard >= nshards) break;
+        if (now - e.fetched > CACHE_MAX_STALE_IF_ERROR || e.obj_size == 0) continue;
+        if (cache_restore(shards[e.shard], p + sizeof(e), e.uri_size, p + sizeof(e) + e.uri_size, e.obj_size,
+                          e.fetched) == 0)
+            n++;
+    }
+    munmap(map, sbuf.st_size);
+    return n;
+}
+
+/* Write n bytes and fold them into the running checksum */
+static int snapshot_write(FILE *fp, const void *buf, size_t n, uint64_t *sum) {
+    const unsigned char *p = buf;
+
+    for (size_t i = 0; i < n; i++) *sum = (*sum ^ p[i]) * FNV_PRIME;
+    return fwrite(buf, 1, n, fp) == n ? 0 : -1;
+}
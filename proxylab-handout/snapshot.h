@@ -0,0 +1,41 @@
+/*
+ * snapshot.h - save the proxy cache to a binary file and load it back,
+ *     so a restart begins with a warm cache
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC "PXYSNAP2"
+#define SNAPSHOT_SHARDS -2 /* snapshot_load: saved with a different number of shards */
+
+/*
+ * File layout, in host byte order: a header, then count entries from
+ * least to most recently used, each a snapshot_entry followed by the URI
+ * (no terminator) and the object. Recency is only ordered within a
+ * shard, so a snapshot loads into as many shards as it was saved from.
+ * checksum is FNV-1a over everything after the header.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t shards;   /* nshards of the proxy that saved it */
+    uint64_t length;   /* Bytes after the header */
+    uint64_t checksum;
+} snapshot_header;
+
+typedef struct {
+    uint32_t uri_size;
+    uint32_t obj_size;
+    int64_t fetched;
+    uint32_t shard;    /* Shard it was saved from */
+    uint32_t reserved;
+} snapshot_entry;
+
+int snapshot_save(const char *path, cache **shards, int nshards);
+int snapshot_load(const char *path, cache **shards, int nshards);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,48 @@
+#include "fcgi.h"
+
+#include "cgipool.h"
+
+/*
+ * fcgi_accept - wait for the next request. Returns 0 with QUERY_STRING
+ *     set and stdout connected to the client, or -1 when there are no
+ *     more requests. Run as a classic CGI program it returns 0 once, so
+ *     the same request loop works under fork/exec.
+ */
+int fcgi_accept(void) {
+    static int requests = 0;
+    int fd, devnull;
+    ssize_t n;
+    char ready = CGI_READY, query[MAXLINE], control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    if (!getenv(CGI_ENV)) return requests++ ? -1 : 0;
+
+    /* Finish the previous response and let go of its connection */
+    fflush(stdout);
+    if (requests++ == 0) signal(SIGPIPE, SIG_IGN);
+    if ((devnull = open("/dev/null", O_WRONLY)) >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    if (send(STDIN_FILENO, &ready, 1, 0) != 1) return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = query;
+    iov.iov_len = sizeof(query) - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(STDIN_FILENO, &msg, 0)) <= 0) return -1; /* Tiny went away */
+    if (!(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    query[n] = '\0';
+    setenv("QUERY_STRING", query, 1);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,5 @@
+/*
+ * fcgi.h - request loop for CGI programs that tiny keeps running as
+ *     persistent workers when they are named *.fcgi (see ../cgipool.h)
+ */
+int fcgi_accept(void);
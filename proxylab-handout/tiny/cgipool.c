@@ -0,0 +1,152 @@
+#include "cgipool.h"
+
+#include <poll.h>
+
+static cgi_program *cgipool_program(cgi_pool *cp, char *filename);
+static int cgipool_spawn(char *filename, pid_t *pidp);
+static int cgipool_send(cgi_worker *w, char *cgiargs, int connfd);
+static void cgipool_kill(cgi_worker *w);
+
+void cgipool_init(cgi_pool *cp) {
+    cp->nprograms = 0;
+    Sem_init(&cp->mutex, 0, 1);
+}
+
+/*
+ * cgipool_serve - hand connfd and cgiargs to an idle persistent worker
+ *     of filename. Returns 0 once the worker owns the request, or -1 if
+ *     filename is not named *CGI_SUFFIX or none of its workers can take
+ *     the request, in which case the caller should fork/exec it instead.
+ */
+int cgipool_serve(cgi_pool *cp, char *filename, char *cgiargs, int connfd) {
+    int rc = -1, sock;
+    size_t len = strlen(filename), slen = strlen(CGI_SUFFIX);
+    ssize_t n;
+    char c;
+    pid_t pid;
+    cgi_program *prog;
+
+    if (len <= slen || strcmp(filename + len - slen, CGI_SUFFIX)) return -1;
+
+    P(&cp->mutex);
+    if ((prog = cgipool_program(cp, filename))) {
+        for (int i = 0; i < CGI_POOL_SIZE && rc < 0; i++) {
+            cgi_worker *w = &prog->workers[i];
+            if (w->spawning) continue;
+            if (w->sock >= 0 && w->busy) {
+                /* Collect the CGI_READY sent when its last request finished */
+                if ((n = recv(w->sock, &c, 1, MSG_DONTWAIT)) < 0 && errno == EAGAIN) continue;
+                if (n == 1 && c == CGI_READY)
+                    w->busy = 0;
+                else
+                    cgipool_kill(w); /* Worker died */
+            }
+            if (w->sock < 0) {
+                /* The handshake can take CGI_READY_TIMEOUT; don't hold up other requests meanwhile */
+                w->spawning = 1;
+                V(&cp->mutex);
+                sock = cgipool_spawn(filename, &pid);
+                P(&cp->mutex);
+                w->spawning = 0;
+                if (sock < 0) continue;
+                w->sock = sock;
+                w->pid = pid;
+                w->busy = 0;
+            }
+            if (cgipool_send(w, cgiargs, connfd) < 0) {
+                cgipool_kill(w);
+                continue;
+            }
+            w->busy = 1;
+            rc = 0;
+        }
+    }
+    V(&cp->mutex);
+    return rc;
+}
+
+/* Find the pool for filename, adding it on first use; caller holds cp->mutex */
+static cgi_program *cgipool_program(cgi_pool *cp, char *filename) {
+    cgi_program *prog;
+
+    for (int i = 0; i < cp->nprograms; i++) {
+        if (!strcmp(cp->programs[i].filename, filename)) return &cp->programs[i];
+    }
+    if (cp->nprograms == CGI_POOL_PROGRAMS) return NULL;
+
+    prog = &cp->programs[cp->nprograms++];
+    prog->filename = (char *)Malloc(strlen(filename) + 1);
+    strcpy(prog->filename, filename);
+    for (int i = 0; i < CGI_POOL_SIZE; i++) {
+        prog->workers[i].sock = -1;
+        prog->workers[i].busy = 0;
+        prog->workers[i].spawning = 0;
+    }
+    return prog; /* Workers start on demand */
+}
+
+/*
+ * cgipool_spawn - start filename as a persistent worker with the
+ *     socketpair on its stdin and wait for its first CGI_READY. Returns
+ *     tiny's end of the socketpair, with the pid in *pidp, or -1. Touches
+ *     no pool state, so it runs without cp->mutex.
+ */
+static int cgipool_spawn(char *filename, pid_t *pidp) {
+    int sv[2], devnull;
+    char c, *argv[] = {filename, NULL};
+    sigset_t mask;
+    struct pollfd pfd;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) return -1;
+    if ((*pidp = Fork()) == 0) {
+        Dup2(sv[1], STDIN_FILENO);
+        devnull = Open("/dev/null", O_WRONLY, 0);
+        Dup2(devnull, STDOUT_FILENO);
+        closefrom(STDERR_FILENO + 1); /* Don't pin other clients' connections open */
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        setenv(CGI_ENV, "1", 1);
+        Execve(filename, argv, environ);
+    }
+    Close(sv[1]);
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGI_READY_TIMEOUT) != 1 || recv(sv[0], &c, 1, 0) != 1 || c != CGI_READY) {
+        kill(*pidp, SIGKILL);
+        Close(sv[0]);
+        return -1;
+    }
+    return sv[0];
+}
+
+/* Send cgiargs (NUL included) with connfd attached as SCM_RIGHTS */
+static int cgipool_send(cgi_worker *w, char *cgiargs, int connfd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = cgiargs;
+    iov.iov_len = strlen(cgiargs) + 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &connfd, sizeof(int));
+
+    return sendmsg(w->sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/* Drop a dead or misbehaving worker; the reaper collects the process */
+static void cgipool_kill(cgi_worker *w) {
+    kill(w->pid, SIGKILL);
+    Close(w->sock);
+    w->sock = -1;
+    w->busy = 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * cgipool.h - pools of persistent CGI workers, FastCGI style
+ *
+ * Each CGI program gets CGI_POOL_SIZE long-lived worker processes, each
+ * connected to tiny by a SOCK_SEQPACKET socketpair on its stdin. Tiny
+ * sends one message per request: the CGI arguments as payload and the
+ * client connection as an SCM_RIGHTS descriptor. The worker answers
+ * with a single CGI_READY byte whenever it can take another request,
+ * including once at startup. Only programs named *CGI_SUFFIX opt in;
+ * everything else is classic CGI and is run with fork/exec, so a
+ * program never runs without a request just to find out which it is.
+ */
+#include "csapp.h"
+
+#define CGI_POOL_SIZE 4         /* Persistent workers per CGI program */
+#define CGI_POOL_PROGRAMS 16    /* Distinct CGI programs that get a pool */
+#define CGI_READY_TIMEOUT 1000  /* Milliseconds a new worker has to answer */
+#define CGI_READY 'R'
+#define CGI_ENV "TINY_CGI_PERSISTENT"
+#define CGI_SUFFIX ".fcgi"      /* Programs named like this run as persistent workers */
+
+typedef struct {
+    int sock;      /* Tiny's end of the socketpair, -1 if no worker */
+    pid_t pid;
+    int busy;      /* A request was sent and CGI_READY not yet seen */
+    int spawning;  /* A thread is starting it without holding the mutex */
+} cgi_worker;
+
+typedef struct {
+    char *filename;
+    cgi_worker workers[CGI_POOL_SIZE];
+} cgi_program;
+
+typedef struct {
+    cgi_program programs[CGI_POOL_PROGRAMS];
+    int nprograms;
+    sem_t mutex;
+} cgi_pool;
+
+void cgipool_init(cgi_pool *cp);
+int cgipool_serve(cgi_pool *cp, char *filename, char *cgiargs, int connfd);
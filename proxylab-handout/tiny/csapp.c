@@ -1,6 +1,9 @@
 /* 
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated 10/2026:
+ *   - Added rio_writev for gathering a response into one system call
+ *
  * Updated 10/2016 reb:
  *   - Fixed bug in sio_ltoa that didn't cover negative numbers
  *
@@ -792,6 +795,45 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write all iovcnt buffers of iov (unbuffered)
+ *
+ *    Lets callers assemble a response from several fragments and send
+ *    it with one writev() in the common case. iov is updated in place
+ *    as a short write advances through it.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0, nleft;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+    nleft = n;
+    while (nleft > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	nleft -= nwritten;
+
+	/* Skip the buffers that went out and trim a partial one */
+	while (iovcnt > 0 && nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (nwritten > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -911,6 +953,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -0,0 +1,136 @@
+#include "fcache.h"
+
+static unsigned fcache_hash(const char *path);
+static int fcache_changed(fcache_entry *e, struct stat *sbuf);
+static void fcache_unlink(fcache *fc, fcache_entry *e);
+static void fcache_release(fcache_entry *e);
+
+void fcache_init(fcache *fc) {
+    memset(fc->buckets, 0, sizeof(fc->buckets));
+    fc->root.prev = &fc->root;
+    fc->root.next = &fc->root;
+    fc->count = 0;
+    Sem_init(&fc->mutex, 0, 1);
+}
+
+/*
+ * fcache_get - return a referenced entry for path, or NULL if it is not
+ *     cached or the file changed since it was opened. The path is only
+ *     re-stat'ed once every FCACHE_REVALIDATE seconds.
+ */
+fcache_entry *fcache_get(fcache *fc, const char *path) {
+    fcache_entry *e;
+    struct stat sbuf;
+    time_t now = time(NULL);
+
+    P(&fc->mutex);
+    for (e = fc->buckets[fcache_hash(path) % FCACHE_BUCKETS]; e; e = e->hnext) {
+        if (!strcmp(e->path, path)) break;
+    }
+    if (e && now - e->checked >= FCACHE_REVALIDATE) {
+        if (stat(path, &sbuf) < 0 || fcache_changed(e, &sbuf)) {
+            fcache_unlink(fc, e);
+            e = NULL;
+        } else {
+            e->checked = now;
+        }
+    }
+    if (e) {
+        /* Move to the front of the LRU list */
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        e->prev = &fc->root;
+        e->next = fc->root.next;
+        e->prev->next = e;
+        e->next->prev = e;
+        e->refcnt++;
+    }
+    V(&fc->mutex);
+    return e;
+}
+
+/*
+ * fcache_add - wrap fd (whose fstat is sbuf) and header in an entry and
+ *     return it referenced. The entry takes ownership of fd and replaces
+ *     any older entry for path; the least recently used entry is evicted
+ *     once FCACHE_MAX_ENTRIES descriptors are cached.
+ */
+fcache_entry *fcache_add(fcache *fc, const char *path, int fd, struct stat *sbuf, const char *header) {
+    fcache_entry *e = (fcache_entry *)Calloc(1, sizeof(fcache_entry));
+    unsigned idx = fcache_hash(path) % FCACHE_BUCKETS;
+
+    e->path = (char *)Malloc(strlen(path) + 1);
+    strcpy(e->path, path);
+    e->fd = fd;
+    e->size = sbuf->st_size;
+    e->dev = sbuf->st_dev;
+    e->ino = sbuf->st_ino;
+    e->mtime = sbuf->st_mtim;
+    e->header_len = strlen(header);
+    e->header = (char *)Malloc(e->header_len + 1);
+    strcpy(e->header, header);
+    e->checked = time(NULL);
+    e->refcnt = 1;
+    e->prev = e->next = e;
+
+    P(&fc->mutex);
+    for (fcache_entry *old = fc->buckets[idx]; old; old = old->hnext) {
+        if (!strcmp(old->path, path)) {
+            fcache_unlink(fc, old);
+            break;
+        }
+    }
+    /* Evict from the cold end of the LRU list to stay under the cap */
+    if (fc->count >= FCACHE_MAX_ENTRIES) fcache_unlink(fc, fc->root.prev);
+
+    e->refcnt++;
+    e->hnext = fc->buckets[idx];
+    fc->buckets[idx] = e;
+    e->prev = &fc->root;
+    e->next = fc->root.next;
+    e->prev->next = e;
+    e->next->prev = e;
+    fc->count++;
+    V(&fc->mutex);
+    return e;
+}
+
+/* fcache_put - drop a reference obtained from fcache_get or fcache_add */
+void fcache_put(fcache *fc, fcache_entry *e) {
+    P(&fc->mutex);
+    fcache_release(e);
+    V(&fc->mutex);
+}
+
+static unsigned fcache_hash(const char *path) {
+    unsigned h = 5381;
+    for (const char *s = path; *s; s++) h = h * 33 + (unsigned char)*s;
+    return h;
+}
+
+static int fcache_changed(fcache_entry *e, struct stat *sbuf) {
+    return sbuf->st_dev != e->dev || sbuf->st_ino != e->ino || sbuf->st_size != e->size ||
+           sbuf->st_mtim.tv_sec != e->mtime.tv_sec || sbuf->st_mtim.tv_nsec != e->mtime.tv_nsec;
+}
+
+/* Remove e from the table and the LRU list; caller holds fc->mutex */
+static void fcache_unlink(fcache *fc, fcache_entry *e) {
+    fcache_entry **pp = &fc->buckets[fcache_hash(e->path) % FCACHE_BUCKETS];
+
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = e;
+    fc->count--;
+    fcache_release(e);
+}
+
+/* Drop one reference and free e with the last one; caller holds fc->mutex */
+static void fcache_release(fcache_entry *e) {
+    if (--e->refcnt > 0) return;
+    Close(e->fd);
+    Free(e->path);
+    Free(e->header);
+    Free(e);
+}
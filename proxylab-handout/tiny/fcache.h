@@ -0,0 +1,37 @@
+/*
+ * fcache.h - cache of open static files and their pre-rendered
+ *     response headers, keyed by path
+ */
+#include "csapp.h"
+
+#define FCACHE_BUCKETS 256
+#define FCACHE_MAX_ENTRIES 512 /* Upper bound on cached descriptors */
+#define FCACHE_REVALIDATE 1    /* Seconds a hit is trusted before re-stat'ing the path */
+
+typedef struct fcache_entry {
+    char *path;
+    int fd;             /* Open, read-only descriptor for path */
+    off_t size;         /* File size when the header was rendered */
+    dev_t dev;          /* Identity and mtime used to detect changes */
+    ino_t ino;
+    struct timespec mtime;
+    char *header;       /* Complete response header, blank line included */
+    int header_len;
+    time_t checked;     /* When path was last stat'ed */
+    int refcnt;         /* Requests using the entry, plus one while cached */
+    struct fcache_entry *hnext;
+    struct fcache_entry *prev; /* LRU list, most recent first */
+    struct fcache_entry *next;
+} fcache_entry;
+
+typedef struct {
+    fcache_entry *buckets[FCACHE_BUCKETS];
+    fcache_entry root; /* LRU list sentinel */
+    int count;
+    sem_t mutex;
+} fcache;
+
+void fcache_init(fcache *fc);
+fcache_entry *fcache_get(fcache *fc, const char *path);
+fcache_entry *fcache_add(fcache *fc, const char *path, int fd, struct stat *sbuf, const char *header);
+void fcache_put(fcache *fc, fcache_entry *e);
@@ -0,0 +1,98 @@
+/* Needs splice and pipe2, so it stays clear of csapp.h and its clash with glibc's GNU gai_error */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tunnel.h"
+
+/* One direction of a tunnel: src -> pipe -> dst */
+typedef struct {
+    int src, dst;
+    int pipefd[2];
+    size_t pending; /* Bytes sitting in the pipe */
+    int eof;        /* src has been read to the end */
+} tunnel_dir;
+
+static int tunnel_step(tunnel_dir *d, short src_events, short dst_events);
+
+/*
+ * tunnel_relay - copy fd1 -> fd2 and fd2 -> fd1 until both sides have
+ *     closed, with splice() so the payload never enters user space. A
+ *     single poll loop drives both directions; an EOF on one side is
+ *     passed on as a half-close once its pipe has drained.
+ *
+ *     Returns 0 after a clean shutdown and -1 on error or idle timeout.
+ *     Both sockets are left non-blocking.
+ */
+int tunnel_relay(int fd1, int fd2) {
+    tunnel_dir dirs[2] = {{fd1, fd2, {-1, -1}, 0, 0}, {fd2, fd1, {-1, -1}, 0, 0}};
+    struct pollfd pfds[2];
+    int rc = 0, i;
+
+    if (pipe2(dirs[0].pipefd, O_NONBLOCK) < 0) return -1;
+    if (pipe2(dirs[1].pipefd, O_NONBLOCK) < 0) {
+        close(dirs[0].pipefd[0]);
+        close(dirs[0].pipefd[1]);
+        return -1;
+    }
+    fcntl(fd1, F_SETFL, fcntl(fd1, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd2, F_SETFL, fcntl(fd2, F_GETFL, 0) | O_NONBLOCK);
+
+    while (!rc && !(dirs[0].eof && !dirs[0].pending && dirs[1].eof && !dirs[1].pending)) {
+        /* Read a side only when its pipe is empty; write it only when the other pipe has data */
+        for (i = 0; i < 2; i++) {
+            pfds[i].events = (!dirs[i].eof && !dirs[i].pending ? POLLIN : 0) | (dirs[!i].pending ? POLLOUT : 0);
+            /* poll reports POLLHUP and POLLERR even unasked; leave out a socket we want nothing from */
+            pfds[i].fd = pfds[i].events ? dirs[i].src : -1;
+            pfds[i].revents = 0;
+        }
+        if ((rc = poll(pfds, 2, TUNNEL_IDLE_TIMEOUT)) <= 0) {
+            if (rc < 0 && errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            rc = -1; /* Idle timeout or poll failure */
+            break;
+        }
+        rc = 0;
+        for (i = 0; i < 2 && !rc; i++) rc = tunnel_step(&dirs[i], pfds[i].revents, pfds[!i].revents);
+    }
+
+    for (i = 0; i < 2; i++) {
+        close(dirs[i].pipefd[0]);
+        close(dirs[i].pipefd[1]);
+    }
+    return rc;
+}
+
+/*
+ * Move what poll reported ready for one direction; -1 on a socket error.
+ * A hung-up or failed source that yields nothing is taken as its end, so
+ * the other direction can still drain.
+ */
+static int tunnel_step(tunnel_dir *d, short src_events, short dst_events) {
+    ssize_t n;
+
+    if (!d->eof && !d->pending && (src_events & (POLLIN | POLLHUP | POLLERR))) {
+        n = splice(d->src, NULL, d->pipefd[1], NULL, TUNNEL_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (src_events & (POLLHUP | POLLERR))) n = 0;
+        if (n < 0 && errno != EAGAIN) return -1;
+        if (n == 0) {
+            d->eof = 1;
+            shutdown(d->dst, SHUT_WR); /* Nothing is pending, so pass the half-close on now */
+        }
+        if (n > 0) {
+            d->pending = n;
+            dst_events |= POLLOUT; /* Usually writable already; try before polling again */
+        }
+    }
+    if (d->pending && (dst_events & (POLLOUT | POLLERR | POLLHUP))) {
+        n = splice(d->pipefd[0], NULL, d->dst, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno != EAGAIN) return -1;
+        if (n > 0) d->pending -= n;
+    }
+    return 0;
+}
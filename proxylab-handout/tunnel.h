@@ -0,0 +1,13 @@
+/*
+ * tunnel.h - relay bytes between two sockets through kernel pipes, for
+ *     CONNECT tunnels
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#define TUNNEL_IDLE_TIMEOUT 60000 /* Milliseconds without traffic before a tunnel is torn down */
+#define TUNNEL_PIPE_SIZE 65536    /* Bytes moved per splice */
+
+int tunnel_relay(int fd1, int fd2);
+
+#endif /* __TUNNEL_H__ */
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# uring-test.sh - checks that a failed connect through the proxy's io_uring
+#     engine (-u) leaves nothing behind on the worker's ring: a refused
+#     connect followed by good fetches, all served by one worker, must
+#     answer 502 and then 200.
+#
+#     usage: ./uring-test.sh
+#
+TIMEOUT=5
+REFUSED_URL="http://127.0.0.1:1/"
+# Different files, so that none of the fetches is a cache hit
+FETCH_LIST="home.html
+            csapp.c
+            tiny.c"
+HOME_DIR=`pwd`
+CONFIG=`mktemp`
+LOG=`mktemp`
+
+#
+# status - print the HTTP status of fetching a URL through the proxy
+# usage: status <url> <proxy_url>
+#
+function status {
+    curl --max-time ${TIMEOUT} --silent --output /dev/null --write-out "%{http_code}" --proxy $2 $1
+}
+
+#
+# wait_for_server - spins until something answers HTTP on a port
+# usage: wait_for_server <port>
+#
+function wait_for_server {
+    for i in `seq 50`
+    do
+        curl --max-time 1 --silent --output /dev/null http://localhost:$1/ && return
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    exit 1
+}
+
+function cleanup {
+    kill ${tiny_pid} ${proxy_pid} 2> /dev/null
+    rm -f ${CONFIG} ${LOG}
+}
+trap cleanup EXIT
+
+if [ ! -x ./proxy ] || [ ! -x ./tiny/tiny ]
+then
+    echo "Error: build ./proxy and ./tiny/tiny first."
+    exit 1
+fi
+
+tiny_port=`./free-port.sh`
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_server ${tiny_port}
+
+# A single worker, so every request below goes through the same ring
+echo "workers 1" > ${CONFIG}
+proxy_port=`./free-port.sh`
+./proxy -u -f ${CONFIG} ${proxy_port} > /dev/null 2> ${LOG} &
+proxy_pid=$!
+wait_for_server ${proxy_port}
+if grep -q "using Rio" ${LOG}
+then
+    echo "Skipped: io_uring is not available here"
+    exit 0
+fi
+
+failed=0
+code=`status ${REFUSED_URL} http://localhost:${proxy_port}`
+echo "Refused connect: ${code}"
+[ "${code}" == "502" ] || failed=1
+for file in ${FETCH_LIST}
+do
+    code=`status http://localhost:${tiny_port}/${file} http://localhost:${proxy_port}`
+    echo "Fetch ${file} after it: ${code}"
+    [ "${code}" == "200" ] || failed=1
+done
+
+if [ ${failed} -eq 0 ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+exit ${failed}
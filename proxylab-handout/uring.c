@@ -0,0 +1,226 @@
+#include "uring.h"
+
+#include <sys/syscall.h>
+
+static int uring_enter(uring *r, unsigned to_submit, unsigned wait_nr);
+
+/*
+ * uring_init - set up a ring with room for entries submissions and map
+ *     its queues. Returns -1 with errno set if the kernel has no io_uring.
+ */
+int uring_init(uring *r, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) return -1;
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz) r->sq_ring_sz = r->cq_ring_sz;
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                      IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            munmap(r->sq_ring, r->sq_ring_sz);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+        munmap(r->sq_ring, r->sq_ring_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    sq = r->sq_ring;
+    cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_deinit(uring *r) {
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+}
+
+/*
+ * uring_register_buffer - pin buf as fixed buffer 0 so that reads into it
+ *     skip the per-request page lookup
+ */
+int uring_register_buffer(uring *r, char *buf, size_t len) {
+    struct iovec iov = {buf, len};
+
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) return -1;
+    r->buf = buf;
+    r->buf_len = len;
+    return 0;
+}
+
+/*
+ * uring_sqe - claim a cleared submission entry, or NULL if the queue is
+ *     full. Entries go to the kernel on the next uring_submit, in order.
+ */
+struct io_uring_sqe *uring_sqe(uring *r, int opcode, int fd, unsigned long long user_data) {
+    unsigned tail = *r->sq_tail + r->sq_pending;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (tail - head > *r->sq_mask) return NULL;
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    r->sq_pending++;
+    return sqe;
+}
+
+/*
+ * uring_reserve - make sure the next n uring_sqe calls succeed, submitting
+ *     pending entries to free up the queue if need be. Returns -1 with
+ *     errno set if that is not enough.
+ */
+int uring_reserve(uring *r, unsigned n) {
+    unsigned used = *r->sq_tail + r->sq_pending - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (*r->sq_mask + 1 - used >= n) return 0;
+    if (r->sq_pending && uring_submit(r, 0) < 0) return -1;
+    used = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (*r->sq_mask + 1 - used >= n) return 0;
+    errno = EBUSY;
+    return -1;
+}
+
+/*
+ * uring_submit - publish pending entries and, with wait_nr > 0, block
+ *     until that many completions are available, all in one system call
+ */
+int uring_submit(uring *r, unsigned wait_nr) {
+    unsigned n = r->sq_pending;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+    return uring_enter(r, n, wait_nr);
+}
+
+/* uring_peek - pop a completion if one is ready; returns 1 if it did */
+int uring_peek(uring *r, struct io_uring_cqe *cqe) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* uring_wait - pop the next completion, blocking until there is one */
+int uring_wait(uring *r, struct io_uring_cqe *cqe) {
+    while (!uring_peek(r, cqe)) {
+        if (uring_enter(r, 0, 1) < 0) return -1;
+    }
+    return 0;
+}
+
+struct io_uring_sqe *uring_prep_accept_multishot(uring *r, int listenfd, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_ACCEPT, listenfd, user_data);
+
+    if (sqe) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return sqe;
+}
+
+struct io_uring_sqe *uring_prep_connect(uring *r, int fd, struct sockaddr *addr, socklen_t len,
+                                        unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_CONNECT, fd, user_data);
+
+    if (sqe) {
+        sqe->addr = (unsigned long)addr;
+        sqe->off = len;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_prep_send(uring *r, int fd, const void *buf, size_t len, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_SEND, fd, user_data);
+
+    if (sqe) {
+        sqe->addr = (unsigned long)buf;
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    return sqe;
+}
+
+/* buf must lie inside the buffer given to uring_register_buffer */
+struct io_uring_sqe *uring_prep_read_fixed(uring *r, int fd, char *buf, size_t len, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_READ_FIXED, fd, user_data);
+
+    if (sqe) {
+        sqe->addr = (unsigned long)buf;
+        sqe->len = len;
+        sqe->off = -1; /* Sockets have no file position */
+        sqe->buf_index = 0;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_prep_poll(uring *r, int fd, unsigned events, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_POLL_ADD, fd, user_data);
+
+    if (sqe) sqe->poll32_events = events;
+    return sqe;
+}
+
+/* Cancels the pending request whose user_data is target */
+struct io_uring_sqe *uring_prep_cancel(uring *r, unsigned long long target, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, user_data);
+
+    if (sqe) sqe->addr = target;
+    return sqe;
+}
+
+/* Bounds the request linked just before it (with IOSQE_IO_LINK) */
+struct io_uring_sqe *uring_prep_link_timeout(uring *r, struct __kernel_timespec *ts, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_LINK_TIMEOUT, -1, user_data);
+
+    if (sqe) {
+        sqe->addr = (unsigned long)ts;
+        sqe->len = 1;
+    }
+    return sqe;
+}
+
+static int uring_enter(uring *r, unsigned to_submit, unsigned wait_nr) {
+    int rc;
+
+    while ((rc = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    return rc;
+}
@@ -0,0 +1,47 @@
+/*
+ * uring.h - a minimal io_uring engine for the proxy, written against the
+ *     raw kernel interface so that no liburing is needed
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "csapp.h"
+
+#define URING_ENTRIES 64
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_pending; /* SQEs handed out but not yet submitted */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    char *buf; /* Registered as fixed buffer 0, if any */
+    size_t buf_len;
+} uring;
+
+int uring_init(uring *r, unsigned entries);
+void uring_deinit(uring *r);
+int uring_register_buffer(uring *r, char *buf, size_t len);
+struct io_uring_sqe *uring_sqe(uring *r, int opcode, int fd, unsigned long long user_data);
+int uring_reserve(uring *r, unsigned n);
+int uring_submit(uring *r, unsigned wait_nr);
+int uring_peek(uring *r, struct io_uring_cqe *cqe);
+int uring_wait(uring *r, struct io_uring_cqe *cqe);
+
+/* SQE preparation helpers; each returns the SQE so flags can be added */
+struct io_uring_sqe *uring_prep_accept_multishot(uring *r, int listenfd, unsigned long long user_data);
+struct io_uring_sqe *uring_prep_connect(uring *r, int fd, struct sockaddr *addr, socklen_t len,
+                                        unsigned long long user_data);
+struct io_uring_sqe *uring_prep_send(uring *r, int fd, const void *buf, size_t len, unsigned long long user_data);
+struct io_uring_sqe *uring_prep_read_fixed(uring *r, int fd, char *buf, size_t len, unsigned long long user_data);
+struct io_uring_sqe *uring_prep_poll(uring *r, int fd, unsigned events, unsigned long long user_data);
+struct io_uring_sqe *uring_prep_cancel(uring *r, unsigned long long target, unsigned long long user_data);
+struct io_uring_sqe *uring_prep_link_timeout(uring *r, struct __kernel_timespec *ts, unsigned long long user_data);
+
+#endif /* __URING_H__ */